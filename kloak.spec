@@ -15,9 +15,7 @@ BuildRequires:  make
 BuildRequires:  pkgconf-pkg-config
 BuildRequires:  pkgconfig(libevdev)
 BuildRequires:  pkgconfig(libsodium)
-BuildRequires:  pkgconfig(udev)
 BuildRequires:  systemd-rpm-macros
-Requires:       systemd-udev
 %{?systemd_requires}
 
 %description
@@ -33,27 +31,23 @@ events, which are typically used for identification.
 
 %install
 %{__install} -Dm 0644 usr/lib/systemd/system/%{name}.service -t %{buildroot}%{_unitdir}
-%{__install} -Dm 0644 lib/udev/rules.d/*.rules -t %{buildroot}%{_udevrulesdir}
 %{__install} -Dm 0755 eventcap -t %{buildroot}%{_sbindir}
 %{__install} -Dm 0755 %{name} -t %{buildroot}%{_sbindir}
 %{__install} -Dm 0644 auto-generated-man-pages/*.8 -t %{buildroot}%{_mandir}/man8
 
 %post
 %systemd_post %{name}.service
-%udev_rules_update
 
 %preun
 %systemd_preun %{name}.service
 
 %postun
 %systemd_postun_with_restart %{name}.service
-%udev_rules_update
 
 %files
 %license COPYING LICENSE
 %doc *.md
 %{_unitdir}/%{name}.service
-%{_udevrulesdir}/*-%{name}.rules
 %{_sbindir}/eventcap
 %{_sbindir}/%{name}
 %{_mandir}/man8/eventcap.8*
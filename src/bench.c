@@ -0,0 +1,333 @@
+// kloak-bench replays traces written by `eventcap -w` through kloak's
+// scheduler on a simulated clock, as fast as it can, and reports how long
+// scheduling took and what it did to the events. It links the same
+// libkloak.a as kloak, so it measures exactly the scheduler kloak runs,
+// only without the device I/O around it.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sodium.h>
+
+#include "scheduler.h"
+#include "stats.h"
+#include "rng.h"
+#include "delay.h"
+#include "trace.h"
+
+#define DEFAULT_MAX_DELAY_MS 100     // as in kloak
+#define NS_PER_MS 1000000L
+#define NS_PER_SEC 1000000000L
+
+#define panic(format, ...) do { fprintf(stderr, format "\n", ## __VA_ARGS__); exit(EXIT_FAILURE); } while (0)
+
+#ifndef max
+#define max(a, b) ( ((a) > (b)) ? (a) : (b) )
+#endif
+
+// A mapped trace file. Its records are replayed in ring order, the
+// events of device d of the trace on scheduler source first_slot + d.
+struct bench_trace {
+        const char *path;
+        const struct trace_header *header;
+        const struct trace_record *ring;
+        size_t size;            // of the mapping
+        uint64_t start;         // ring index of the oldest record
+        uint64_t count;         // records in the ring
+        uint64_t next;          // records replayed so far
+        int first_slot;
+};
+
+static struct bench_trace *traces = NULL;
+static int trace_count = 0;
+static int64_t *last_released = NULL;  // timestamp of the last frame released, per queue
+static uint64_t released = 0;
+static uint64_t bursts = 0;             // release times, i.e. timer wakeups and uinput writes
+static int64_t last_burst = -1;
+static uint64_t order_violations = 0;
+static uint64_t events = 0;             // events replayed
+static int64_t first = -1, last = 0;    // simulated time of the first and the last event
+
+static struct option long_options[] = {
+    {"delay",   1, 0, 'd'},
+    {"distribution", 1, 0, 'D'},
+    {"adaptive", 1, 0, 'a'},
+    {"motion-delay", 1, 0, 'm'},
+    {"coalesce", 1, 0, 'c'},
+    {"independent", 0, 0, 'i'},
+    {"frames",  0, 0, 'f'},
+    {"runs",    1, 0, 'n'},
+    {"help",    0, 0, 'h'},
+    {0,         0, 0, 0}
+};
+
+int64_t current_time_ns(void) {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (int64_t)spec.tv_sec * NS_PER_SEC + spec.tv_nsec;
+}
+
+// Receives the events kloak would have written to uinput. Within a queue
+// frames must come out in the order they were read: no event may be older
+// than the SYN_REPORT of a frame released before it. Inside a frame the
+// order may change, coalescing inserts newer motion into older frames.
+void bench_emit(const struct entry *e, int64_t now) {
+    int q = sched_queue_of(e->device_index);
+    int64_t t = (int64_t)e->iev.input_event_sec * NS_PER_SEC + (int64_t)e->iev.input_event_usec * 1000L;
+
+    if (t < last_released[q])
+        order_violations++;
+    else if (e->iev.type == EV_SYN)
+        last_released[q] = t;
+    if (now != last_burst)
+        bursts++;
+    last_burst = now;
+    released++;
+}
+
+// Maps a trace. All its pages are read in up front, so that file I/O is
+// not part of the measurement.
+void bench_load(struct bench_trace *t) {
+    const struct trace_header *h;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(t->path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        panic("Could not open trace %s: %s", t->path, strerror(errno));
+    if ((size_t)st.st_size < TRACE_DATA_OFFSET)
+        panic("%s is not a kloak trace", t->path);
+    t->size = (size_t)st.st_size;
+    if ((h = mmap(NULL, t->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0)) == MAP_FAILED)
+        panic("Could not map trace %s: %s", t->path, strerror(errno));
+    close(fd);
+
+    if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0)
+        panic("%s is not a kloak trace", t->path);
+    if (h->version != TRACE_VERSION || h->record_size != sizeof(struct trace_record))
+        panic("%s: unsupported trace version %u", t->path, h->version);
+    if (h->capacity == 0 || h->device_count == 0 || h->device_count > TRACE_MAX_DEVICES)
+        panic("%s: corrupt trace header", t->path);
+
+    t->header = h;
+    t->ring = (const struct trace_record *)((const char *)h + TRACE_DATA_OFFSET);
+    t->count = h->written < h->capacity ? h->written : h->capacity;
+    t->start = h->written < h->capacity ? 0 : h->written % h->capacity;
+    if (t->size < TRACE_DATA_OFFSET + t->count * sizeof(struct trace_record))
+        panic("%s: trace is truncated", t->path);
+    t->next = 0;
+}
+
+const struct trace_record *bench_record(const struct bench_trace *t) {
+    return &t->ring[(t->start + t->next) % t->header->capacity];
+}
+
+// Returns the trace with the earliest next event, or NULL when all are done
+struct bench_trace *bench_next() {
+    struct bench_trace *best = NULL;
+
+    for (int i = 0; i < trace_count; i++) {
+        if (traces[i].next < traces[i].count
+            && (best == NULL || bench_record(&traces[i])->time < bench_record(best)->time))
+            best = &traces[i];
+    }
+    return best;
+}
+
+void bench_usage() {
+    fprintf(stderr, "Usage: kloak-bench [options] trace_file...\n");
+    fprintf(stderr, "Replays traces written by eventcap -w through the kloak scheduler, every\n"
+            "device captured as one input device, and reports scheduling throughput, delays,\n"
+            "queue depth and event ordering. The options are those of kloak:\n");
+    fprintf(stderr, "  -d delay, -D name[:param], -a delay, -m delay, -c window, -i, -f\n");
+    fprintf(stderr, "  -n runs: replay the traces this many times and report the fastest run.\n"
+            "     Default 1.\n");
+}
+
+// Replays all traces once through a freshly set up scheduler and returns
+// how long it took. The statistics are those of this run.
+int64_t bench_run(const struct sched_config *config) {
+    const struct trace_device *d;
+    struct bench_trace *t;
+    const struct trace_record *r;
+    struct input_event ev;
+    int64_t now = 0, next_release = -1, wall_start;
+    int slots = 0;
+
+    if (sched_init(config) < 0)
+        panic("Failed to set up the scheduler");
+    for (int i = 0; i < trace_count; i++) {
+        traces[i].first_slot = slots;
+        traces[i].next = 0;
+        for (uint32_t j = 0; j < traces[i].header->device_count; j++) {
+            d = &traces[i].header->devices[j];
+            if (sched_add_source(slots++, (d->ev_bits & (1 << EV_KEY)) ? device_class_of((int)d->key_count)
+                                                                       : DEVICE_POINTER) < 0)
+                panic("Failed to allocate memory for trace %s", traces[i].path);
+        }
+    }
+    free(last_released);
+    if ((last_released = calloc(sched_queue_count(), sizeof(*last_released))) == NULL)
+        panic("Failed to allocate memory for the order checks");
+    released = bursts = order_violations = events = 0;
+    last_burst = first = -1;
+    last = 0;
+
+    // The simulated clock jumps from one event to the next and to every
+    // release time in between, so events are released exactly when due
+    wall_start = current_time_ns();
+    while ((t = bench_next()) != NULL) {
+        r = bench_record(t);
+        t->next++;
+        if (r->device >= t->header->device_count)
+            panic("%s: corrupt record for device %u", t->path, r->device);
+        // the devices of one trace are read in turns, so their events
+        // can be a little out of order; the clock never goes back
+        now = max(now, r->time);
+        if (first < 0)
+            first = now;
+
+        while (next_release >= 0 && next_release <= now)
+            next_release = sched_release_due(next_release);
+
+        // stamped with the arrival time, which the order check compares
+        ev.input_event_sec = (time_t)(now / NS_PER_SEC);
+        ev.input_event_usec = (suseconds_t)(now % NS_PER_SEC / 1000);
+        ev.type = r->type;
+        ev.code = r->code;
+        ev.value = r->value;
+        sched_schedule(t->first_slot + r->device, &ev, now);
+        next_release = sched_release_due(now);
+        events++;
+    }
+    while (next_release >= 0) {
+        last = next_release;
+        next_release = sched_release_due(next_release);
+    }
+    last = max(last, now);
+    return current_time_ns() - wall_start;
+}
+
+int main(int argc, char **argv) {
+    int64_t wall = -1, run_wall;
+    int runs = 1;
+    char label[PATH_MAX + TRACE_NAME_SIZE + 4];
+    int max_delay = DEFAULT_MAX_DELAY_MS, max_motion_delay = -1, min_adaptive_delay = -1;
+    int coalesce_window = 0, independent = 0, frames = 0;
+    struct sched_config config;
+    int c;
+
+    if (sodium_init() == -1)
+        panic("sodium_init failed");
+    rng_init();
+
+    while ((c = getopt_long(argc, argv, "d:D:a:m:c:ifn:h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'd':
+            if ((max_delay = atoi(optarg)) < 0)
+                panic("Maximum delay must be >= 0\n");
+            break;
+        case 'D':
+            if (delay_set_distribution(optarg) != 0)
+                panic("Unknown delay distribution or invalid parameter: %s\n", optarg);
+            break;
+        case 'a':
+            if ((min_adaptive_delay = atoi(optarg)) < 0)
+                panic("Minimum adaptive delay must be >= 0\n");
+            break;
+        case 'm':
+            if ((max_motion_delay = atoi(optarg)) < 0)
+                panic("Maximum pointer delay must be >= 0\n");
+            break;
+        case 'c':
+            if ((coalesce_window = atoi(optarg)) < 0)
+                panic("Coalescing window must be >= 0\n");
+            break;
+        case 'i':
+            independent = 1;
+            break;
+        case 'f':
+            frames = 1;
+            break;
+        case 'n':
+            if ((runs = atoi(optarg)) <= 0)
+                panic("Number of runs must be > 0\n");
+            break;
+        default:
+            bench_usage();
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        bench_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    if (min_adaptive_delay > max_delay)
+        panic("Minimum adaptive delay must not exceed the maximum delay\n");
+
+    // the same settings kloak derives from these options
+    config = (struct sched_config){
+        .max_delay_ns = {
+            [DEVICE_KEYBOARD] = (int64_t)max_delay * NS_PER_MS,
+            [DEVICE_POINTER] = (int64_t)(max_motion_delay >= 0 ? max_motion_delay : max_delay) * NS_PER_MS,
+        },
+        .min_adaptive_delay_ns = min_adaptive_delay >= 0 ? (int64_t)min_adaptive_delay * NS_PER_MS : -1,
+        .coalesce_window_ns = (int64_t)coalesce_window * NS_PER_MS,
+        .grouping = independent ? SCHED_PER_SOURCE : max_motion_delay >= 0 ? SCHED_PER_CLASS : SCHED_SHARED,
+        .frames = frames,
+        .emit = bench_emit,
+    };
+
+    trace_count = argc - optind;
+    if ((traces = calloc((size_t)trace_count, sizeof(*traces))) == NULL)
+        panic("Failed to allocate memory for the traces");
+    for (int i = 0; i < trace_count; i++) {
+        traces[i].path = argv[optind + i];
+        bench_load(&traces[i]);
+        if (traces[i].header->clock_id != traces[0].header->clock_id)
+            panic("%s was captured on another clock than %s", traces[i].path, traces[0].path);
+    }
+
+    for (int run = 0; run < runs; run++) {
+        run_wall = bench_run(&config);
+        if (wall < 0 || run_wall < wall)
+            wall = run_wall;
+    }
+
+    printf("kloak-bench: %" PRIu64 " events from %d traces spanning %.1f s\n",
+           events, trace_count, first >= 0 ? (double)(last - first) / NS_PER_SEC : 0.0);
+    printf("scheduled in %.3f ms%s: %.2f M events/s, %.0fx real time\n",
+           (double)wall / NS_PER_MS, runs > 1 ? " at best" : "",
+           wall > 0 ? (double)events * 1000.0 / (double)wall : 0.0,
+           wall > 0 ? (double)(last - first) / (double)wall : 0.0);
+    printf("%" PRIu64 " events released in %" PRIu64 " bursts, %" PRIu64 " out of order, "
+           "%lu released early on queue overflow\n", released, bursts, order_violations, sched_overflows());
+    for (int i = 0; i < trace_count; i++) {
+        if (traces[i].header->dropped > 0)
+            printf("%s: the kernel dropped events %" PRIu64 " times while capturing\n",
+                   traces[i].path, traces[i].header->dropped);
+        for (uint32_t j = 0; j < traces[i].header->device_count; j++) {
+            snprintf(label, sizeof(label), "%s (%s)", traces[i].path, traces[i].header->devices[j].name);
+            stats_print_device(stdout, label, sched_stats(traces[i].first_slot + (int)j), last - first);
+        }
+    }
+
+    for (int i = 0; i < trace_count; i++)
+        munmap((void *)traces[i].header, traces[i].size);
+    free(traces);
+    free(last_released);
+    sched_free();
+    rng_wipe();
+
+    return order_violations > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,281 @@
+// kloak-check drives kloak's scheduler with random input from several
+// keyboards and pointers on a simulated clock, in every combination of
+// queue grouping, frame mode, coalescing and adaptive mode, and checks
+// what comes out: no key event is lost, every source's events leave in
+// the order they came in, no event is held longer than its maximum delay
+// (plus the coalescing window it may have been merged across) and no
+// relative motion is lost to coalescing. `make check` runs it.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sodium.h>
+
+#include "scheduler.h"
+#include "stats.h"
+#include "rng.h"
+#include "delay.h"
+
+#define SOURCES 4                    // keyboards and pointers in turns
+#define FRAMES 20000                 // per mode
+#define BURST_INTERVAL 5000          // frames between two bursts
+#define BURST_FRAMES 2000            // pointer frames arriving at once, more than a queue holds
+#define KEY_CODES 16                 // keys pressed, from KEY_1 on
+
+#define MAX_DELAY_MS 100
+#define MAX_MOTION_DELAY_MS 30       // for the groupings that support a pointer delay of its own
+#define COALESCE_WINDOW_MS 10
+#define MIN_ADAPTIVE_DELAY_MS 5
+#define NS_PER_MS 1000000L
+#define NS_PER_SEC 1000000000L
+
+#define panic(format, ...) do { fprintf(stderr, format "\n", ## __VA_ARGS__); exit(EXIT_FAILURE); } while (0)
+
+struct key_event {
+        uint16_t code;
+        int32_t value;
+};
+
+// What went into and came out of the scheduler for one source
+struct source_log {
+        enum device_class class;
+        struct key_event *keys;     // key events scheduled, in order
+        size_t keys_in;
+        size_t keys_out;
+        uint32_t held;              // keys pressed, bit i is KEY_1 + i
+        int64_t rel_in[REL_CNT];    // sums of the relative motion scheduled
+        int64_t rel_out[REL_CNT];
+        uint64_t events_in;
+        uint64_t events_out;
+        int64_t last_arrival;       // of the last event released
+};
+
+static struct source_log sources[SOURCES];
+static int64_t *last_time = NULL;   // release time of the last event released, per queue
+static const struct sched_config *config;
+static char mode[128];
+static uint64_t violations = 0;
+static uint64_t early = 0;          // events released before they were due
+static uint64_t seed = 1;
+
+#define violation(format, ...) do { \
+        if (violations++ < 10) \
+            fprintf(stderr, "kloak-check: %s: " format "\n", mode, ## __VA_ARGS__); \
+    } while (0)
+
+// xorshift64*, so that a failing run can be repeated with its seed
+static uint64_t next_random(void) {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 0x2545F4914F6CDD1DULL;
+}
+
+static uint32_t random_below(uint32_t n) {
+    return (uint32_t)(next_random() >> 32) % n;
+}
+
+void check_emit(const struct entry *e, int64_t now) {
+    struct source_log *s;
+    const struct key_event *k;
+    int q;
+
+    if (e->device_index < 0 || e->device_index >= SOURCES) {
+        violation("event released for unknown source %d", e->device_index);
+        return;
+    }
+    s = &sources[e->device_index];
+    q = sched_queue_of(e->device_index);
+    s->events_out++;
+
+    if (now < e->time)
+        early++;
+    if (now - e->arrival > config->max_delay_ns[s->class] + config->coalesce_window_ns)
+        violation("source %d: event held for %" PRId64 " ms", e->device_index, (now - e->arrival) / NS_PER_MS);
+    if (e->arrival < s->last_arrival)
+        violation("source %d: event of %" PRId64 " released after one of %" PRId64,
+                  e->device_index, e->arrival, s->last_arrival);
+    s->last_arrival = e->arrival;
+    if (e->time < last_time[q])
+        violation("queue %d: release time went back from %" PRId64 " to %" PRId64, q, last_time[q], e->time);
+    last_time[q] = e->time;
+
+    if (e->iev.type == EV_KEY) {
+        if (s->keys_out >= s->keys_in) {
+            violation("source %d: key event released that was never scheduled", e->device_index);
+            return;
+        }
+        k = &s->keys[s->keys_out++];
+        if (e->iev.code != k->code || e->iev.value != k->value)
+            violation("source %d: key event %zu released as code %u value %d, scheduled as code %u value %d",
+                      e->device_index, s->keys_out - 1, e->iev.code, e->iev.value, k->code, k->value);
+    } else if (e->iev.type == EV_REL && e->iev.code < REL_CNT) {
+        s->rel_out[e->iev.code] += e->iev.value;
+    }
+}
+
+static int64_t schedule(int source, uint16_t type, uint16_t code, int32_t value, int64_t now, int64_t next_release) {
+    struct source_log *s = &sources[source];
+    struct input_event ev;
+
+    while (next_release >= 0 && next_release <= now)
+        next_release = sched_release_due(next_release);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.input_event_sec = (time_t)(now / NS_PER_SEC);
+    ev.input_event_usec = (suseconds_t)(now % NS_PER_SEC / 1000);
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    if (type == EV_KEY)
+        s->keys[s->keys_in++] = (struct key_event){ code, value };
+    else if (type == EV_REL)
+        s->rel_in[code] += value;
+    s->events_in++;
+    sched_schedule(source, &ev, now);
+    return sched_release_due(now);
+}
+
+// One SYN_REPORT frame of the source: a key press, repeat or release on
+// a keyboard, motion and now and then a button on a pointer
+static int64_t schedule_frame(int source, int64_t now, int64_t next_release) {
+    struct source_log *s = &sources[source];
+    uint32_t key = random_below(KEY_CODES);
+    int32_t value;
+
+    if (s->class == DEVICE_KEYBOARD) {
+        value = !(s->held & (1u << key)) ? 1 : random_below(4) == 0 ? 2 : 0;
+        if (value == 1)
+            s->held |= 1u << key;
+        else if (value == 0)
+            s->held &= ~(1u << key);
+        if (value != 2)
+            next_release = schedule(source, EV_MSC, MSC_SCAN, (int32_t)(0x70000 + key), now, next_release);
+        next_release = schedule(source, EV_KEY, (uint16_t)(KEY_1 + key), value, now, next_release);
+    } else {
+        if (random_below(4) != 0)
+            next_release = schedule(source, EV_REL, REL_X, (int32_t)random_below(21) - 10, now, next_release);
+        if (random_below(2) != 0)
+            next_release = schedule(source, EV_REL, REL_Y, (int32_t)random_below(21) - 10, now, next_release);
+        if (random_below(32) == 0) {
+            value = !(s->held & 1u);
+            s->held ^= 1u;
+            next_release = schedule(source, EV_KEY, BTN_LEFT, value, now, next_release);
+        }
+    }
+    return schedule(source, EV_SYN, SYN_REPORT, 0, now, next_release);
+}
+
+// Runs FRAMES random frames through a freshly set up scheduler and
+// checks what was released
+static void check_run(const struct sched_config *c) {
+    struct source_log *s;
+    int64_t now = 0, next_release = -1;
+    int burst_source;
+
+    config = c;
+    if (sched_init(c) < 0)
+        panic("Failed to set up the scheduler for %s", mode);
+    for (int i = 0; i < SOURCES; i++) {
+        s = &sources[i];
+        free(s->keys);
+        *s = (struct source_log){ .class = i % 2 == 0 ? DEVICE_KEYBOARD : DEVICE_POINTER };
+        // a pointer frame holds one key event at most
+        if ((s->keys = calloc(FRAMES + BURST_FRAMES * (FRAMES / BURST_INTERVAL + 1), sizeof(*s->keys))) == NULL)
+            panic("Failed to allocate memory for the key log");
+        if (sched_add_source(i, s->class) < 0)
+            panic("Failed to add source %d", i);
+    }
+    early = 0;
+    free(last_time);
+    if ((last_time = calloc(sched_queue_count(), sizeof(*last_time))) == NULL)
+        panic("Failed to allocate memory for the order checks");
+
+    for (int frame = 0; frame < FRAMES; frame++) {
+        // several frames often arrive at the same time, and then and
+        // again more pointer motion at once than a queue can hold
+        if (random_below(5) != 0)
+            now += (int64_t)random_below(20 * NS_PER_MS);
+        if (frame % BURST_INTERVAL == BURST_INTERVAL - 1) {
+            burst_source = (int)random_below(SOURCES / 2) * 2 + 1;
+            for (int i = 0; i < BURST_FRAMES; i++)
+                next_release = schedule_frame(burst_source, now, next_release);
+        }
+        next_release = schedule_frame((int)random_below(SOURCES), now, next_release);
+    }
+    while (next_release >= 0)
+        next_release = sched_release_due(next_release);
+
+    for (int i = 0; i < SOURCES; i++) {
+        s = &sources[i];
+        if (s->keys_out != s->keys_in)
+            violation("source %d: %zu of %zu key events released", i, s->keys_out, s->keys_in);
+        for (int code = 0; code < REL_CNT; code++)
+            if (s->rel_out[code] != s->rel_in[code])
+                violation("source %d: relative motion %d summed to %" PRId64 ", scheduled %" PRId64,
+                          i, code, s->rel_out[code], s->rel_in[code]);
+        // coalescing merges frames, nothing else may drop an event
+        if (c->coalesce_window_ns == 0 && s->events_out != s->events_in)
+            violation("source %d: %" PRIu64 " of %" PRIu64 " events released", i, s->events_out, s->events_in);
+    }
+    // only a full queue releases an event before its time
+    if (early > sched_overflows())
+        violation("%" PRIu64 " events released early, %lu on queue overflow", early, sched_overflows());
+    printf("%-50s %s, %lu released early on queue overflow\n",
+           mode, violations > 0 ? "FAILED" : "ok", sched_overflows());
+    sched_free();
+}
+
+int main(int argc, char **argv) {
+    static const char *grouping_names[] = {
+        [SCHED_SHARED] = "shared", [SCHED_PER_CLASS] = "per class", [SCHED_PER_SOURCE] = "per source",
+    };
+    struct sched_config c;
+    uint64_t failed = 0;
+    int runs = 0;
+
+    if (argc > 2 || (argc == 2 && (seed = strtoull(argv[1], NULL, 0)) == 0)) {
+        fprintf(stderr, "Usage: kloak-check [seed]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sodium_init() == -1)
+        panic("sodium_init failed");
+    rng_init();
+
+    printf("kloak-check: seed %" PRIu64 "\n", seed);
+    for (int grouping = SCHED_SHARED; grouping <= SCHED_PER_SOURCE; grouping++) {
+        for (int mask = 0; mask < 8; mask++) {
+            c = (struct sched_config){
+                .max_delay_ns = {
+                    [DEVICE_KEYBOARD] = MAX_DELAY_MS * NS_PER_MS,
+                    [DEVICE_POINTER] = (grouping == SCHED_SHARED ? MAX_DELAY_MS : MAX_MOTION_DELAY_MS) * NS_PER_MS,
+                },
+                .min_adaptive_delay_ns = (mask & 4) ? MIN_ADAPTIVE_DELAY_MS * NS_PER_MS : -1,
+                .coalesce_window_ns = (mask & 2) ? COALESCE_WINDOW_MS * NS_PER_MS : 0,
+                .grouping = (enum sched_grouping)grouping,
+                .frames = (mask & 1) != 0,
+                .emit = check_emit,
+            };
+            snprintf(mode, sizeof(mode), "%s queues%s%s%s", grouping_names[grouping],
+                     c.frames ? ", frames" : "", c.coalesce_window_ns > 0 ? ", coalescing" : "",
+                     c.min_adaptive_delay_ns >= 0 ? ", adaptive" : "");
+            violations = 0;
+            check_run(&c);
+            failed += violations > 0;
+            runs++;
+        }
+    }
+
+    for (int i = 0; i < SOURCES; i++)
+        free(sources[i].keys);
+    free(last_time);
+    rng_wipe();
+
+    if (failed > 0)
+        panic("kloak-check: %" PRIu64 " of %d modes FAILED, seed %s", failed, runs, argc == 2 ? argv[1] : "1");
+    printf("kloak-check: all %d modes passed\n", runs);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "delay.h"
+#include "rng.h"
+
+#define DELAY_ONE (1ULL << DELAY_FRACTION_BITS)
+#define DELAY_INDEX_SHIFT (DELAY_FRACTION_BITS - DELAY_TABLE_BITS)
+
+// Truncated to [0, 1] with rate `param`. For a given mean this is the
+// maximum entropy distribution on the window, i.e. it gives the least
+// information about the typing for the latency it adds.
+static double exponential_inverse_cdf(double u, double param) {
+    return -log1p(-u * -expm1(-param)) / param;
+}
+
+// Density falling linearly from the lower bound to zero at the max delay,
+// a third of the window on average
+static double triangular_inverse_cdf(double u, double param) {
+    return 1.0 - sqrt(1.0 - u);
+}
+
+static const struct delay_distribution distributions[] = {
+    { "uniform", "uniform on the window (default)", NULL, 0.0, false },
+    { "exponential", "truncated exponential, :rate sets how steeply it falls off (default 4)",
+      exponential_inverse_cdf, 4.0, true },
+    { "triangular", "linearly decreasing density", triangular_inverse_cdf, 0.0, false },
+};
+
+static const struct delay_distribution *current = &distributions[0];
+static double current_param = 0.0;
+
+// Fractions of the window for DELAY_TABLE_SIZE + 1 evenly spaced
+// quantiles, the last one being 1.0
+static uint64_t table[DELAY_TABLE_SIZE + 1];
+
+static void build_table(void) {
+    double x;
+
+    for (size_t i = 0; i <= DELAY_TABLE_SIZE; i++) {
+        x = current->inverse_cdf((double)i / DELAY_TABLE_SIZE, current_param);
+        if (!(x >= 0.0))
+            x = 0.0;
+        if (x > 1.0)
+            x = 1.0;
+        table[i] = (uint64_t)(x * (double)DELAY_ONE);
+    }
+    // rounding must never let the table decrease
+    for (size_t i = 1; i <= DELAY_TABLE_SIZE; i++) {
+        if (table[i] < table[i - 1])
+            table[i] = table[i - 1];
+    }
+}
+
+// Selects a distribution by a "name" or "name:param" spec and builds its
+// table. Returns -1 if the name is unknown, or the parameter is invalid
+// or given to a distribution that takes none.
+int delay_set_distribution(const char *spec) {
+    const char *sep = strchr(spec, ':');
+    size_t len = sep ? (size_t)(sep - spec) : strlen(spec);
+    double param;
+    char *end;
+
+    for (size_t i = 0; i < sizeof(distributions) / sizeof(distributions[0]); i++) {
+        if (strlen(distributions[i].name) != len || strncmp(distributions[i].name, spec, len) != 0)
+            continue;
+
+        param = distributions[i].default_param;
+        if (sep && !distributions[i].has_param)
+            return -1;
+        if (sep) {
+            param = strtod(sep + 1, &end);
+            if (end == sep + 1 || *end != '\0' || !(param > 0.0))
+                return -1;
+        }
+
+        current = &distributions[i];
+        current_param = param;
+        if (current->inverse_cdf)
+            build_table();
+        return 0;
+    }
+    return -1;
+}
+
+const char *delay_distribution_name(void) {
+    return current->name;
+}
+
+double delay_distribution_param(void) {
+    return current_param;
+}
+
+void delay_list_distributions(FILE *f) {
+    for (size_t i = 0; i < sizeof(distributions) / sizeof(distributions[0]); i++)
+        fprintf(f, "       %-12s %s\n", distributions[i].name, distributions[i].description);
+}
+
+// Returns a delay in [lower, upper] drawn from the current distribution
+int64_t delay_sample(int64_t lower, int64_t upper) {
+    uint64_t range, u, index, frac, x;
+
+    // default to max if the interval is not valid
+    if (lower >= upper)
+        return upper;
+    range = (uint64_t)(upper - lower);
+
+    if (current->inverse_cdf == NULL)
+        return lower + (int64_t)rng_uniform(range + 1);
+
+    // the high bits of u pick the table interval, the low bits the
+    // position inside it
+    u = rng_uniform(DELAY_ONE);
+    index = u >> DELAY_INDEX_SHIFT;
+    frac = u & ((1ULL << DELAY_INDEX_SHIFT) - 1);
+    x = table[index] + (((table[index + 1] - table[index]) * frac) >> DELAY_INDEX_SHIFT);
+
+    return lower + (int64_t)(((unsigned __int128)range * x) >> DELAY_FRACTION_BITS);
+}
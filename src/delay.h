@@ -0,0 +1,30 @@
+#ifndef DELAY_H
+#define DELAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Delay distributions. Each is described by its inverse CDF on [0, 1],
+// from which a table is built at startup, so that sampling a delay costs
+// one random draw and a linear interpolation between two table entries,
+// whatever the shape. Samples are scaled onto [lower bound, max delay].
+#define DELAY_TABLE_BITS 12
+#define DELAY_TABLE_SIZE (1 << DELAY_TABLE_BITS)
+#define DELAY_FRACTION_BITS 32       // table entries are fixed point, 1 << 32 is 1.0
+
+struct delay_distribution {
+        const char *name;
+        const char *description;
+        double (*inverse_cdf)(double, double);  // NULL samples uniformly without a table
+        double default_param;
+        bool has_param;     // takes a "name:param" spec
+};
+
+int delay_set_distribution(const char *);
+const char *delay_distribution_name(void);
+double delay_distribution_param(void);
+void delay_list_distributions(FILE *);
+int64_t delay_sample(int64_t, int64_t);
+
+#endif
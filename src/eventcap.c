@@ -7,6 +7,9 @@
 #include <dirent.h>
 #include <termios.h>
 #include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
 
 #include <linux/input.h>
 
@@ -14,11 +17,21 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 
-volatile int running = 1;
+#include "trace.h"
+
+#define READ_BATCH_SIZE 64           // max events read from a device per read()
+#define DEFAULT_CAPACITY (1 << 20)   // records in the trace ring, 24 MiB
+
+volatile sig_atomic_t running = 1;
 
 void usage() {
-    fprintf(stderr, "Usage: eventcap <device>\n");
+    fprintf(stderr, "Usage: eventcap [-w trace_file [-n records]] <device>...\n");
+    fprintf(stderr, "  -w trace_file: write the events of all devices to a binary trace for\n"
+            "     kloak-bench instead of printing them\n");
+    fprintf(stderr, "  -n records: size of the trace ring. Once it is full the oldest events are\n"
+            "     overwritten. Default %d.\n", DEFAULT_CAPACITY);
     exit(1);
 }
 
@@ -26,47 +39,220 @@ void handle_signal(int signal) {
     running = 0;
 }
 
-int main(int argc, char *argv[]) {
-    struct input_event ev;
+// Describes device fd in a trace header, so that kloak-bench can treat its
+// events like the device they came from
+int trace_device_init(int fd, struct trace_device *d) {
+    struct input_id id;
+    unsigned long evbit = 0;
+
+    memset(d, 0, sizeof(*d));
+    if (ioctl(fd, EVIOCGNAME(sizeof(d->name) - 1), d->name) == -1
+        || ioctl(fd, EVIOCGID, &id) == -1
+        || ioctl(fd, EVIOCGBIT(0, sizeof(evbit)), &evbit) == -1)
+        return -1;
+    d->bustype = id.bustype;
+    d->vendor = id.vendor;
+    d->product = id.product;
+    d->version = id.version;
+    d->ev_bits = (uint32_t)evbit;
+
+    // the bitmaps are kept as the kernel returns them
+    if ((evbit & (1 << EV_KEY)) && ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(d->key_bits)), d->key_bits) == -1)
+        return -1;
+    if ((evbit & (1 << EV_REL)) && ioctl(fd, EVIOCGBIT(EV_REL, sizeof(d->rel_bits)), &d->rel_bits) == -1)
+        return -1;
+    if ((evbit & (1 << EV_ABS)) && ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(d->abs_bits)), &d->abs_bits) == -1)
+        return -1;
+    for (size_t i = 0; i < TRACE_KEY_WORDS; i++) {
+        d->key_count += (uint32_t)__builtin_popcountll(d->key_bits[i]);
+    }
+    return 0;
+}
+
+// Creates the trace file with room for `capacity` records and maps it.
+// The blocks are allocated up front, so that running out of disk space
+// fails here rather than with a SIGBUS while capturing.
+struct trace_header *trace_create(const char *path, uint64_t capacity, size_t *size) {
+    struct trace_header *h;
     int fd;
+
+    *size = TRACE_DATA_OFFSET + capacity * sizeof(struct trace_record);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+        return NULL;
+    if ((errno = posix_fallocate(fd, 0, (off_t)*size)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    h = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+        return NULL;
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+    h->version = TRACE_VERSION;
+    h->record_size = sizeof(struct trace_record);
+    h->capacity = capacity;
+    return h;
+}
+
+int main(int argc, char *argv[]) {
+    struct input_event evs[READ_BATCH_SIZE], *ev;
+    struct pollfd fds[TRACE_MAX_DEVICES];
+    struct trace_header *header = NULL;
+    struct trace_record *ring = NULL, *record;
+    struct sigaction sa;
+    int opt;
+    int device_count;
     char name[256] = "Unknown";
-    char *device = NULL;
+    char *trace_file = NULL;
+    unsigned long long capacity = DEFAULT_CAPACITY;
+    size_t trace_size = 0;
+    clockid_t clock_id = CLOCK_MONOTONIC;
+    ssize_t len;
 
-    if (argc < 2) {
+    while ((opt = getopt(argc, argv, "w:n:h")) != -1) {
+        switch (opt) {
+        case 'w':
+            trace_file = optarg;
+            break;
+        case 'n':
+            if ((capacity = strtoull(optarg, NULL, 10)) == 0)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    device_count = argc - optind;
+    if (device_count <= 0 || device_count > TRACE_MAX_DEVICES) {
         usage();
     }
 
     if (getuid() != 0)
         printf("You are not root! This may not work...\n");
 
-    device = argv[1];
-
-    // Open Device
-    if ((fd = open(device, O_RDONLY)) == -1) {
-        fprintf(stderr, "%s is not a valid device\n", device);
-        exit(1);
+    if (trace_file) {
+        if ((header = trace_create(trace_file, capacity, &trace_size)) == NULL) {
+            fprintf(stderr, "Failed to create trace %s: %s\n", trace_file, strerror(errno));
+            exit(1);
+        }
+        ring = (struct trace_record *)((char *)header + TRACE_DATA_OFFSET);
+        header->device_count = (uint32_t)device_count;
     }
 
-    // Print Device Name
-    if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) == -1) {
-        fprintf(stderr, "Failed to get device name\n");
-        exit(1);
+    for (int i = 0; i < device_count; i++) {
+        // Open Device
+        if ((fds[i].fd = open(argv[optind + i], O_RDONLY)) == -1) {
+            fprintf(stderr, "%s is not a valid device\n", argv[optind + i]);
+            exit(1);
+        }
+        fds[i].events = POLLIN;
+
+        // Print Device Name
+        if (ioctl(fds[i].fd, EVIOCGNAME(sizeof(name)), name) == -1) {
+            fprintf(stderr, "Failed to get device name\n");
+            exit(1);
+        }
+        printf("Reading From: %s (%s)\n", argv[optind + i], name);
+
+        // Timestamps of all devices on one clock, kloak's, so that the
+        // events of several devices can be merged. The evdev default is
+        // CLOCK_REALTIME, which is used if the kernel refuses.
+        if (ioctl(fds[i].fd, EVIOCSCLOCKID, &clock_id) == -1)
+            clock_id = CLOCK_REALTIME;
+
+        if (header && trace_device_init(fds[i].fd, &header->devices[i]) == -1) {
+            fprintf(stderr, "Failed to get device capabilities\n");
+            exit(1);
+        }
+    }
+    if (header) {
+        // a device that refused the monotonic clock puts everything on CLOCK_REALTIME
+        for (int i = 0; clock_id == CLOCK_REALTIME && i < device_count; i++)
+            ioctl(fds[i].fd, EVIOCSCLOCKID, &clock_id);
+        header->clock_id = (uint32_t)clock_id;
+        printf("Writing trace to %s, press Ctrl-C to stop\n", trace_file);
     }
-    printf("Reading From: %s (%s)\n", device, name);
 
-    // Set up signal handler for graceful termination
-    signal(SIGINT, handle_signal);
+    // Set up signal handler for graceful termination. Without SA_RESTART,
+    // so that the signal interrupts poll() waiting for the next event.
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
     while (running) {
-        if (read(fd, &ev, sizeof(struct input_event)) <= 0) {
-            perror("read()");
+        if (poll(fds, (nfds_t)device_count, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll()");
             exit(1);
         }
-        printf("Type: %*d    Code: %*d    Value: %*d\n", 3, ev.type, 3, ev.code, 3, ev.value);
+
+        for (int i = 0; i < device_count; i++) {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            // one read() returns all the events the device has buffered,
+            // up to a batch, and never blocks after poll() said it is ready
+            if ((len = read(fds[i].fd, evs, sizeof(evs))) <= 0) {
+                if (len < 0 && errno == EINTR)
+                    continue;
+                // keep what was captured up to an unplug
+                if (len < 0 && errno == ENODEV && header) {
+                    fprintf(stderr, "%s was removed, stopping\n", argv[optind + i]);
+                    running = 0;
+                    break;
+                }
+                perror("read()");
+                exit(1);
+            }
+
+            for (size_t j = 0; j < (size_t)len / sizeof(struct input_event); j++) {
+                ev = &evs[j];
+                if (header) {
+                    record = &ring[(header->written + j) % header->capacity];
+                    record->time = (int64_t)ev->input_event_sec * 1000000000L + (int64_t)ev->input_event_usec * 1000L;
+                    record->type = ev->type;
+                    record->code = ev->code;
+                    record->value = ev->value;
+                    record->device = (uint16_t)i;
+                    if (ev->type == EV_SYN && ev->code == SYN_DROPPED)
+                        header->dropped++;
+                } else if (device_count > 1) {
+                    printf("Device: %d    Type: %*d    Code: %*d    Value: %*d\n", i, 3, ev->type, 3, ev->code, 3, ev->value);
+                } else {
+                    printf("Type: %*d    Code: %*d    Value: %*d\n", 3, ev->type, 3, ev->code, 3, ev->value);
+                }
+            }
+            // publishes the batch to anyone reading the trace while it is written
+            if (header)
+                header->written += (size_t)len / sizeof(struct input_event);
+        }
     }
 
-    // Close the device
-    close(fd);
+    if (header) {
+        unsigned long long written = header->written;
+        unsigned long long dropped = header->dropped;
+
+        if (msync(header, trace_size, MS_SYNC) == -1
+            || (written < capacity
+                && truncate(trace_file, (off_t)(TRACE_DATA_OFFSET + written * sizeof(struct trace_record))) == -1)) {
+            fprintf(stderr, "Failed to write trace %s: %s\n", trace_file, strerror(errno));
+            exit(1);
+        }
+        munmap(header, trace_size);
+        printf("Wrote %llu events to %s\n", written < capacity ? written : capacity, trace_file);
+        if (written > capacity)
+            printf("The ring wrapped, the oldest %llu events were overwritten\n", written - capacity);
+        if (dropped > 0)
+            printf("The kernel dropped events %llu times, the capture is not complete\n", dropped);
+    }
+
+    // Close the devices
+    for (int i = 0; i < device_count; i++)
+        close(fds[i].fd);
 
     return 0;
 }
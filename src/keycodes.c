@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include <linux/input.h>
 #include "keycodes.h"
@@ -7,171 +8,177 @@ struct name_value {
     const int value;
 };
 
-static struct name_value key_table[] = {
-        {"KEY_ESC", KEY_ESC},
-        {"KEY_1", KEY_1},
-        {"KEY_2", KEY_2},
-        {"KEY_3", KEY_3},
-        {"KEY_4", KEY_4},
-        {"KEY_5", KEY_5},
-        {"KEY_6", KEY_6},
-        {"KEY_7", KEY_7},
-        {"KEY_8", KEY_8},
-        {"KEY_9", KEY_9},
-        {"KEY_0", KEY_0},
-        {"KEY_MINUS", KEY_MINUS},
-        {"KEY_EQUAL", KEY_EQUAL},
-        {"KEY_BACKSPACE", KEY_BACKSPACE},
-        {"KEY_TAB", KEY_TAB},
-        {"KEY_Q", KEY_Q},
-        {"KEY_W", KEY_W},
-        {"KEY_E", KEY_E},
-        {"KEY_R", KEY_R},
-        {"KEY_T", KEY_T},
-        {"KEY_Y", KEY_Y},
-        {"KEY_U", KEY_U},
-        {"KEY_I", KEY_I},
-        {"KEY_O", KEY_O},
-        {"KEY_P", KEY_P},
-        {"KEY_LEFTBRACE", KEY_LEFTBRACE},
-        {"KEY_RIGHTBRACE", KEY_RIGHTBRACE},
-        {"KEY_ENTER", KEY_ENTER},
-        {"KEY_LEFTCTRL", KEY_LEFTCTRL},
-        {"KEY_A", KEY_A},
-        {"KEY_S", KEY_S},
-        {"KEY_D", KEY_D},
-        {"KEY_F", KEY_F},
-        {"KEY_G", KEY_G},
-        {"KEY_H", KEY_H},
-        {"KEY_J", KEY_J},
-        {"KEY_K", KEY_K},
-        {"KEY_L", KEY_L},
-        {"KEY_SEMICOLON", KEY_SEMICOLON},
-        {"KEY_APOSTROPHE", KEY_APOSTROPHE},
-        {"KEY_GRAVE", KEY_GRAVE},
-        {"KEY_LEFTSHIFT", KEY_LEFTSHIFT},
-        {"KEY_BACKSLASH", KEY_BACKSLASH},
-        {"KEY_Z", KEY_Z},
-        {"KEY_X", KEY_X},
-        {"KEY_C", KEY_C},
-        {"KEY_V", KEY_V},
-        {"KEY_B", KEY_B},
-        {"KEY_N", KEY_N},
-        {"KEY_M", KEY_M},
-        {"KEY_COMMA", KEY_COMMA},
-        {"KEY_DOT", KEY_DOT},
-        {"KEY_SLASH", KEY_SLASH},
-        {"KEY_RIGHTSHIFT", KEY_RIGHTSHIFT},
-        {"KEY_KPASTERISK", KEY_KPASTERISK},
-        {"KEY_LEFTALT", KEY_LEFTALT},
-        {"KEY_SPACE", KEY_SPACE},
-        {"KEY_CAPSLOCK", KEY_CAPSLOCK},
-        {"KEY_F1", KEY_F1},
-        {"KEY_F2", KEY_F2},
-        {"KEY_F3", KEY_F3},
-        {"KEY_F4", KEY_F4},
-        {"KEY_F5", KEY_F5},
-        {"KEY_F6", KEY_F6},
-        {"KEY_F7", KEY_F7},
-        {"KEY_F8", KEY_F8},
-        {"KEY_F9", KEY_F9},
-        {"KEY_F10", KEY_F10},
-        {"KEY_NUMLOCK", KEY_NUMLOCK},
-        {"KEY_SCROLLLOCK", KEY_SCROLLLOCK},
-        {"KEY_KP7", KEY_KP7},
-        {"KEY_KP8", KEY_KP8},
-        {"KEY_KP9", KEY_KP9},
-        {"KEY_KPMINUS", KEY_KPMINUS},
-        {"KEY_KP4", KEY_KP4},
-        {"KEY_KP5", KEY_KP5},
-        {"KEY_KP6", KEY_KP6},
-        {"KEY_KPPLUS", KEY_KPPLUS},
-        {"KEY_KP1", KEY_KP1},
-        {"KEY_KP2", KEY_KP2},
-        {"KEY_KP3", KEY_KP3},
-        {"KEY_KP0", KEY_KP0},
-        {"KEY_KPDOT", KEY_KPDOT},
+// Every key name, sorted by strcmp() so that lookup_keycode() can do a
+// binary search; keep it sorted when adding keys. ALIAS marks a second
+// name for a code, which lookup_keyname() never returns.
+#define KEYCODE_LIST(KEY, ALIAS) \
+    KEY(KEY_0) \
+    KEY(KEY_1) \
+    KEY(KEY_102ND) \
+    KEY(KEY_2) \
+    KEY(KEY_3) \
+    KEY(KEY_4) \
+    KEY(KEY_5) \
+    KEY(KEY_6) \
+    KEY(KEY_7) \
+    KEY(KEY_8) \
+    KEY(KEY_9) \
+    KEY(KEY_A) \
+    KEY(KEY_APOSTROPHE) \
+    KEY(KEY_B) \
+    KEY(KEY_BACKSLASH) \
+    KEY(KEY_BACKSPACE) \
+    KEY(KEY_C) \
+    KEY(KEY_CAPSLOCK) \
+    KEY(KEY_COMMA) \
+    KEY(KEY_COMPOSE) \
+    KEY(KEY_D) \
+    KEY(KEY_DELETE) \
+    KEY(KEY_DOT) \
+    KEY(KEY_DOWN) \
+    KEY(KEY_E) \
+    KEY(KEY_END) \
+    KEY(KEY_ENTER) \
+    KEY(KEY_EQUAL) \
+    KEY(KEY_ESC) \
+    KEY(KEY_F) \
+    KEY(KEY_F1) \
+    KEY(KEY_F10) \
+    KEY(KEY_F11) \
+    KEY(KEY_F12) \
+    KEY(KEY_F13) \
+    KEY(KEY_F14) \
+    KEY(KEY_F15) \
+    KEY(KEY_F16) \
+    KEY(KEY_F17) \
+    KEY(KEY_F18) \
+    KEY(KEY_F19) \
+    KEY(KEY_F2) \
+    KEY(KEY_F20) \
+    KEY(KEY_F21) \
+    KEY(KEY_F22) \
+    KEY(KEY_F23) \
+    KEY(KEY_F24) \
+    KEY(KEY_F3) \
+    KEY(KEY_F4) \
+    KEY(KEY_F5) \
+    KEY(KEY_F6) \
+    KEY(KEY_F7) \
+    KEY(KEY_F8) \
+    KEY(KEY_F9) \
+    KEY(KEY_G) \
+    KEY(KEY_GRAVE) \
+    KEY(KEY_H) \
+    KEY(KEY_HANGEUL) \
+    ALIAS(KEY_HANGUEL)          /* same code as KEY_HANGEUL */ \
+    KEY(KEY_HANJA) \
+    KEY(KEY_HENKAN) \
+    KEY(KEY_HIRAGANA) \
+    KEY(KEY_HOME) \
+    KEY(KEY_I) \
+    KEY(KEY_INSERT) \
+    KEY(KEY_J) \
+    KEY(KEY_K) \
+    KEY(KEY_KATAKANA) \
+    KEY(KEY_KATAKANAHIRAGANA) \
+    KEY(KEY_KP0) \
+    KEY(KEY_KP1) \
+    KEY(KEY_KP2) \
+    KEY(KEY_KP3) \
+    KEY(KEY_KP4) \
+    KEY(KEY_KP5) \
+    KEY(KEY_KP6) \
+    KEY(KEY_KP7) \
+    KEY(KEY_KP8) \
+    KEY(KEY_KP9) \
+    KEY(KEY_KPASTERISK) \
+    KEY(KEY_KPCOMMA) \
+    KEY(KEY_KPDOT) \
+    KEY(KEY_KPENTER) \
+    KEY(KEY_KPEQUAL) \
+    KEY(KEY_KPJPCOMMA) \
+    KEY(KEY_KPMINUS) \
+    KEY(KEY_KPPLUS) \
+    KEY(KEY_KPPLUSMINUS) \
+    KEY(KEY_KPSLASH) \
+    KEY(KEY_L) \
+    KEY(KEY_LEFT) \
+    KEY(KEY_LEFTALT) \
+    KEY(KEY_LEFTBRACE) \
+    KEY(KEY_LEFTCTRL) \
+    KEY(KEY_LEFTMETA) \
+    KEY(KEY_LEFTSHIFT) \
+    KEY(KEY_LINEFEED) \
+    KEY(KEY_M) \
+    KEY(KEY_MACRO) \
+    KEY(KEY_MINUS) \
+    KEY(KEY_MUHENKAN) \
+    KEY(KEY_MUTE) \
+    KEY(KEY_N) \
+    KEY(KEY_NUMLOCK) \
+    KEY(KEY_O) \
+    KEY(KEY_P) \
+    KEY(KEY_PAGEDOWN) \
+    KEY(KEY_PAGEUP) \
+    KEY(KEY_PAUSE) \
+    KEY(KEY_POWER) \
+    KEY(KEY_Q) \
+    KEY(KEY_R) \
+    KEY(KEY_RIGHT) \
+    KEY(KEY_RIGHTALT) \
+    KEY(KEY_RIGHTBRACE) \
+    KEY(KEY_RIGHTCTRL) \
+    KEY(KEY_RIGHTMETA) \
+    KEY(KEY_RIGHTSHIFT) \
+    KEY(KEY_RO) \
+    KEY(KEY_S) \
+    KEY(KEY_SCALE) \
+    KEY(KEY_SCROLLLOCK) \
+    KEY(KEY_SEMICOLON) \
+    KEY(KEY_SLASH) \
+    KEY(KEY_SPACE) \
+    KEY(KEY_SYSRQ) \
+    KEY(KEY_T) \
+    KEY(KEY_TAB) \
+    KEY(KEY_U) \
+    KEY(KEY_UNKNOWN) \
+    KEY(KEY_UP) \
+    KEY(KEY_V) \
+    KEY(KEY_VOLUMEDOWN) \
+    KEY(KEY_VOLUMEUP) \
+    KEY(KEY_W) \
+    KEY(KEY_X) \
+    KEY(KEY_Y) \
+    KEY(KEY_YEN) \
+    KEY(KEY_Z) \
+    KEY(KEY_ZENKAKUHANKAKU)
 
-        {"KEY_ZENKAKUHANKAKU", KEY_ZENKAKUHANKAKU},
-        {"KEY_102ND", KEY_102ND},
-        {"KEY_F11", KEY_F11},
-        {"KEY_F12", KEY_F12},
-        {"KEY_RO", KEY_RO},
-        {"KEY_KATAKANA", KEY_KATAKANA},
-        {"KEY_HIRAGANA", KEY_HIRAGANA},
-        {"KEY_HENKAN", KEY_HENKAN},
-        {"KEY_KATAKANAHIRAGANA", KEY_KATAKANAHIRAGANA},
-        {"KEY_MUHENKAN", KEY_MUHENKAN},
-        {"KEY_KPJPCOMMA", KEY_KPJPCOMMA},
-        {"KEY_KPENTER", KEY_KPENTER},
-        {"KEY_RIGHTCTRL", KEY_RIGHTCTRL},
-        {"KEY_KPSLASH", KEY_KPSLASH},
-        {"KEY_SYSRQ", KEY_SYSRQ},
-        {"KEY_RIGHTALT", KEY_RIGHTALT},
-        {"KEY_LINEFEED", KEY_LINEFEED},
-        {"KEY_HOME", KEY_HOME},
-        {"KEY_UP", KEY_UP},
-        {"KEY_PAGEUP", KEY_PAGEUP},
-        {"KEY_LEFT", KEY_LEFT},
-        {"KEY_RIGHT", KEY_RIGHT},
-        {"KEY_END", KEY_END},
-        {"KEY_DOWN", KEY_DOWN},
-        {"KEY_PAGEDOWN", KEY_PAGEDOWN},
-        {"KEY_INSERT", KEY_INSERT},
-        {"KEY_DELETE", KEY_DELETE},
-        {"KEY_MACRO", KEY_MACRO},
-        {"KEY_MUTE", KEY_MUTE},
-        {"KEY_VOLUMEDOWN", KEY_VOLUMEDOWN},
-        {"KEY_VOLUMEUP", KEY_VOLUMEUP},
-        {"KEY_POWER", KEY_POWER},
-        {"KEY_KPEQUAL", KEY_KPEQUAL},
-        {"KEY_KPPLUSMINUS", KEY_KPPLUSMINUS},
-        {"KEY_PAUSE", KEY_PAUSE},
-        {"KEY_SCALE", KEY_SCALE},
+#define TABLE_ENTRY(key) {#key, key},
+#define NAME_ENTRY(key) [key] = #key,
+#define NO_NAME_ENTRY(key)
 
-        {"KEY_KPCOMMA", KEY_KPCOMMA},
-        {"KEY_HANGEUL", KEY_HANGEUL},
-        {"KEY_HANGUEL", KEY_HANGUEL},
-        {"KEY_HANJA", KEY_HANJA},
-        {"KEY_YEN", KEY_YEN},
-        {"KEY_LEFTMETA", KEY_LEFTMETA},
-        {"KEY_RIGHTMETA", KEY_RIGHTMETA},
-        {"KEY_COMPOSE", KEY_COMPOSE},
-
-        {"KEY_F13", KEY_F13},
-        {"KEY_F14", KEY_F14},
-        {"KEY_F15", KEY_F15},
-        {"KEY_F16", KEY_F16},
-        {"KEY_F17", KEY_F17},
-        {"KEY_F18", KEY_F18},
-        {"KEY_F19", KEY_F19},
-        {"KEY_F20", KEY_F20},
-        {"KEY_F21", KEY_F21},
-        {"KEY_F22", KEY_F22},
-        {"KEY_F23", KEY_F23},
-        {"KEY_F24", KEY_F24},
-
-        {"KEY_UNKNOWN", KEY_UNKNOWN},
+static const struct name_value key_table[] = {
+    KEYCODE_LIST(TABLE_ENTRY, TABLE_ENTRY)
+};
 
-        {NULL, 0}
+static const char *const key_names[KEY_MAX + 1] = {
+    KEYCODE_LIST(NAME_ENTRY, NO_NAME_ENTRY)
 };
 
+static int compare_name(const void *key, const void *entry) {
+    return strcmp(key, ((const struct name_value *)entry)->name);
+}
+
 int lookup_keycode(const char *name) {
-    struct name_value *p;
-    for (p = key_table; p->name != NULL; ++p) {
-        if (strcmp(p->name, name) == 0) {
-            return p->value;
-        }
-    }
-    return -1;
+    const struct name_value *p;
+
+    p = bsearch(name, key_table, sizeof(key_table) / sizeof(key_table[0]),
+                sizeof(key_table[0]), compare_name);
+    return p ? p->value : -1;
 }
 
 const char *lookup_keyname(const int code) {
-    struct name_value *p;
-    for (p = key_table; p->name != NULL; ++p) {
-        if (code == p->value) {
-            return p->name;
-        }
-    }
-    return "KEY_UNKNOWN";
+    if (code < 0 || code > KEY_MAX || key_names[code] == NULL)
+        return "KEY_UNKNOWN";
+    return key_names[code];
 }
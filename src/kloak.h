@@ -1,26 +1,110 @@
 #ifndef KLOAK_H
 #define KLOAK_H
 
-struct entry {
-        struct input_event iev;
-        long time;
-        TAILQ_ENTRY(entry) entries;
-        int device_index;
+// Startup phases that are timed, in order. Input is unprotected until the
+// end of STARTUP_GRAB, and only forwarded again after STARTUP_OUTPUTS.
+enum startup_phase {
+        STARTUP_DETECT,     // scanning /dev/input, skipped with -r
+        STARTUP_OPEN,
+        STARTUP_WAIT,       // waiting for held keys to be released
+        STARTUP_GRAB,
+        STARTUP_OUTPUTS,    // creating the uinput devices
+        STARTUP_PHASE_COUNT
+};
+
+// Single-producer, single-consumer ring of entries. head and tail only
+// ever grow and are on separate cache lines, so the two threads do not
+// contend on them.
+struct spsc_ring {
+        struct entry *slots;
+        size_t capacity;    // power of two
+        _Alignas(64) atomic_size_t head;    // next entry to pop, written by the consumer
+        _Alignas(64) atomic_size_t tail;    // next entry to push, written by the producer
+};
+
+// One input device and the uinput device its events are released to.
+// Slots are reused after a device is removed; free slots have no path.
+// The fields used for every event come first.
+struct device {
+        int fd;             // -1 while closed
+        unsigned int out_count; // events staged in out_events
+        unsigned int read_batch;    // max events read per wakeup, sized from the capabilities
+        bool read_pending;  // the last read stopped at read_batch with events left
+        struct libevdev_uinput *uidev;
+        struct input_event *out_events; // WRITE_BATCH_SIZE events for one write()
+        struct libevdev *evdev;
+        unsigned long *held_keys;   // bitmap of keys pressed on the uinput device
+        char *path;
 };
 
 ssize_t strtcpy(char *, const char *, size_t);
-void sleep_ms(long int);
-long current_time_ms(void);
-long int random_between(long int, long int);
+int64_t current_time_ns(void);
 void set_rescue_keys(const char*);
 int supports_event_type(int, int);
-int supports_specific_key(int, unsigned int);
+int count_supported_keys(int);
 int is_keyboard(int);
 int is_mouse(int);
+int supported_codes(int, unsigned int, unsigned long *, size_t);
+unsigned int read_batch_size(int);
+int keys_held(int, unsigned long *);
+bool rescue_pressed(const struct input_event *);
+long wait_for_key_release(int);
+int is_kloak_device(int);
+void device_table_grow(int);
+int device_table_add(const char *);
+void device_table_remove(int);
+int is_event_node(const struct dirent *);
 void detect_devices();
+void init_epoll();
+void watch_fd(int, uint32_t);
+void arm_timer(int64_t);
+void init_slot(int, enum device_class);
+int open_device(const char *);
+void watch_input(int, enum device_class);
+int open_input(int);
+int grab_input(int);
 void init_inputs();
+int init_output(int);
 void init_outputs();
-void emit_event(struct entry *);
+void init_hotplug();
+void add_device(const char *);
+void remove_device(int);
+void handle_hotplug();
+void release_held_keys(int);
+void flush_device(int);
+void flush_events();
+void emit_event(const struct entry *, int64_t);
+int64_t release_due_events(int64_t);
+void spsc_init(struct spsc_ring *, size_t);
+bool spsc_push(struct spsc_ring *, const struct entry *);
+bool spsc_pop(struct spsc_ring *, struct entry *);
+size_t spsc_count(struct spsc_ring *);
+void wake_emitter();
+void handoff_event(int, const struct input_event *, int64_t);
+void wait_for_space();
+void drain_handoff(int64_t);
+void lock_emitter();
+void unlock_emitter();
+void *emitter_main(void *);
+void start_emitter();
+void wake_vlog();
+void *vlog_main(void *);
+void start_vlog();
+void stop_vlog();
+void stop_emitter();
+int parse_cpu_list(const char *, cpu_set_t *);
+void prefault_stack();
+void tune_process();
+void check_build_variant();
+void init_scheduler();
+void print_startup(FILE *);
+void benchmark_startup(int);
+void handle_sigusr1(int);
+void init_signals();
+void print_stats(FILE *, int64_t);
+void write_stats_file(int64_t);
+int64_t arrival_time(const struct input_event *, int64_t);
+void read_device(int, int64_t);
 void main_loop();
 void usage();
 void banner();
@@ -1,28 +1,65 @@
 #define _GNU_SOURCE
-#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <time.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/prctl.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <dirent.h>
 #include <sodium.h>
-#include <sys/queue.h>
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
 
+#include "scheduler.h"
 #include "kloak.h"
 #include "keycodes.h"
+#include "stats.h"
+#include "vlog.h"
+#include "rng.h"
+#include "delay.h"
 
 #define BUFSIZE 256                  // for device names and rescue key sequence
-#define MAX_INPUTS 48                // number of devices to try autodetection
-#define MAX_DEVICES 48               // max number of devices to read events from
+#define DEVICE_TABLE_INITIAL 8       // device slots allocated up front, the table grows as needed
 #define MAX_RESCUE_KEYS 10           // max number of rescue keys to exit in case of emergency
-#define MIN_KEYBOARD_KEYS 20         // need at least this many keys to be a keyboard
-#define POLL_TIMEOUT_MS 1            // timeout to check for new events
+#define READ_BATCH_SIZE 64           // max events read from a device per read() while starting
+#define READ_BATCH_FRAMES 4          // full reports a device may have read per wakeup
+#define READ_BATCH_MIN 16            // events, enough for a few key presses
+#define READ_BATCH_MAX 1024
+#define WRITE_BATCH_SIZE 64          // max events written to a uinput device per write()
+#define QUEUE_CAPACITY 4096          // max events in the handoff ring, must be a power of two
 #define DEFAULT_MAX_DELAY_MS 100      // upper bound on event delay
 #define DEFAULT_STARTUP_DELAY_MS 500 // wait before grabbing the input device
+#define NS_PER_MS 1000000L           // scheduler clock resolution
+#define NS_PER_SEC 1000000000L
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+#define KEY_BITMAP_WORDS (KEY_MAX / BITS_PER_LONG + 1)
+#define KEY_BIT_WORD(code) ((size_t)(code) / BITS_PER_LONG)
+#define KEY_BIT_MASK(code) (1UL << ((size_t)(code) % BITS_PER_LONG))
+#define DEFAULT_STATS_INTERVAL_S 10  // how often the statistics file is rewritten
+#define EPOLL_BATCH_SIZE 64          // max ready sources handled per wakeup
+#define EPOLL_TIMER UINT32_MAX       // epoll token of the release timer, devices use their slot
+#define EPOLL_HOTPLUG (UINT32_MAX - 1) // epoll token of the /dev/input watch
+#define PREFAULT_STACK_SIZE (256 * 1024) // stack touched up front when locking memory
+#define THREAD_STACK_SIZE (512 * 1024)   // stack of kloak's own threads when locking memory
 
 #define panic(format, ...) do { fprintf(stderr, format "\n", ## __VA_ARGS__); fflush(stderr); cleanup(); exit(EXIT_FAILURE); } while (0)
 
@@ -41,25 +78,102 @@ static int interrupt = 0;       // flag to interrupt the main loop and exit
 static int verbose = 0;         // flag for verbose output
 static int persistent = 0;      // flag for persistent mode (diables rescue key sequence)
 static int custom_rescue = 0;   // flag for setting a custom rescue key sequence
+static int independent = 0;     // flag for scheduling every device on its own queue
+static int frames = 0;          // flag for giving every SYN_REPORT frame a single delay
+static int hotplug = 0;         // flag for adding and removing autodetected devices while running
+static int threaded = 0;        // flag for releasing events from a separate emitter thread
+static int rt_priority = 0;     // SCHED_FIFO priority of the releasing thread, 0 to not change
+static int lock_memory = 0;     // flag for locking all memory once the devices are set up
+static int renice = 0;          // flag for changing the nice value to nice_level
+static int nice_level = 0;
+static char affinity_str[BUFSIZE] = "";  // CPUs to run on as given, empty to not pin
+static cpu_set_t affinity;
+static int kernel_time = 0;     // flag for scheduling from the kernel timestamps of the events
+
+// The flags a build variant can fix, for the hot path; see scheduler.h.
+// check_build_variant() makes sure the command line asks for the same.
+static inline bool verbose_mode(void) {
+#ifdef KLOAK_VERBOSE
+    return KLOAK_VERBOSE;
+#else
+    return verbose;
+#endif
+}
+
+static inline bool persistent_mode(void) {
+#ifdef KLOAK_PERSISTENT
+    return KLOAK_PERSISTENT;
+#else
+    return persistent;
+#endif
+}
 
 static char rescue_key_seps[] = ", ";  // delims to strtok
 static char rescue_keys_str[BUFSIZE] = "KEY_LEFTSHIFT,KEY_RIGHTSHIFT,KEY_ESC";
 static int rescue_keys[MAX_RESCUE_KEYS];  // Codes of the rescue key combo
 static int rescue_len = 0;      // Number of rescue keys, set during initialization
+static unsigned long rescue_mask[KEY_BITMAP_WORDS];  // bitmap of the rescue keys
+static unsigned long keys_down[KEY_BITMAP_WORDS];    // keys held on any input device
 
 static int max_delay = DEFAULT_MAX_DELAY_MS;  // lag will never exceed this upper bound
+static int max_motion_delay = -1;   // upper bound for pointer devices, -1 to use max_delay
+static int min_adaptive_delay = -1; // adaptive mode shrinks the delay window down to this, -1 disables
+static int coalesce_window = 0;     // merge relative motion queued within this many ms, 0 disables
 static int startup_timeout = DEFAULT_STARTUP_DELAY_MS;
 
-static unsigned int device_count = 0;
-static char named_inputs[MAX_INPUTS][BUFSIZE];
+static char stats_file[BUFSIZE] = "";   // statistics are periodically written here if set
+static int stats_interval = DEFAULT_STATS_INTERVAL_S;
+static volatile sig_atomic_t stats_requested = 0;   // set by SIGUSR1
+static int64_t start_time = 0;
+static int64_t last_arrival = 0;    // arrival time of the last event read, for kernel_time
+
+static int benchmark_runs = 0;      // run the startup this many times and exit, 0 to start normally
+static int64_t process_start = 0;
+static int64_t startup_ns[STARTUP_PHASE_COUNT];  // how long each phase of the last startup took
+static int64_t grabbed_at = 0;      // when the last input device was grabbed
+static const char *startup_phase_names[STARTUP_PHASE_COUNT] = {
+    [STARTUP_DETECT] = "detect",
+    [STARTUP_OPEN] = "open",
+    [STARTUP_WAIT] = "wait",
+    [STARTUP_GRAB] = "grab",
+    [STARTUP_OUTPUTS] = "outputs",
+};
+
+// Input devices, indexed by slot. device_count is one past the highest
+// slot in use; the table and everything indexed by slot grow together.
+static struct device *devices = NULL;
+static int device_count = 0;
+static int device_capacity = 0;
+static int read_backlog = 0;        // devices left with events after a full read batch
 
-static int input_fds[MAX_INPUTS];
-struct libevdev *output_devs[MAX_INPUTS];
-struct libevdev_uinput *uidevs[MAX_INPUTS];
+// Devices with events staged for the next flush_events()
+static int *out_pending = NULL;
+static unsigned int out_pending_count = 0;
+
+// Every device, the /dev/input watch and the release timer are sources of
+// one epoll set, so a wakeup only touches the sources that are ready
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static int inotify_fd = -1;
 
 static struct option long_options[] = {
     {"read",    1, 0, 'r'},
     {"delay",   1, 0, 'd'},
+    {"distribution", 1, 0, 'D'},
+    {"adaptive", 1, 0, 'a'},
+    {"motion-delay", 1, 0, 'm'},
+    {"coalesce", 1, 0, 'c'},
+    {"independent", 0, 0, 'i'},
+    {"frames",  0, 0, 'f'},
+    {"threaded", 0, 0, 't'},
+    {"kernel-time", 0, 0, 'K'},
+    {"realtime", 1, 0, 'R'},
+    {"affinity", 1, 0, 'A'},
+    {"nice",    1, 0, 'N'},
+    {"lock-memory", 0, 0, 'L'},
+    {"stats-file", 1, 0, 'S'},
+    {"stats-interval", 1, 0, 'T'},
+    {"benchmark-startup", 1, 0, 'B'},
     {"start",   1, 0, 's'},
     {"keys",    1, 0, 'k'},
     {"verbose", 0, 0, 'v'},
@@ -67,7 +181,36 @@ static struct option long_options[] = {
     {0,         0, 0, 0}
 };
 
-TAILQ_HEAD(tailhead, entry) head;
+// Threaded mode: the main thread reads and schedules events and hands them
+// to the emitter thread through `handoff`, which owns the queues and the
+// uinput devices. The emitter sleeps in ppoll() on `wake_fd` and sets
+// `emitter_waiting` before doing so, so that the reader only has to write
+// to it when the emitter might be asleep.
+static struct spsc_ring handoff;
+static int64_t *handoff_tails = NULL;  // release time of the last event handed off, per queue
+static pthread_t emitter_thread;
+static bool emitter_running = false;
+static atomic_bool emitter_waiting = false;
+static atomic_bool emitter_stop = false;
+static int wake_fd = -1;
+static atomic_bool reader_waiting = false;  // the main thread sleeps on space_fd for a full ring
+static int space_fd = -1;
+// Held by the emitter while it queues and releases events, and by the main
+// thread while a device is added or removed: that may move the device
+// table and the scheduler's sources, and must not leave a removed device's
+// events in the ring when its slot is reused. It inherits the emitter's
+// priority, and the main thread only holds it for table updates.
+static pthread_mutex_t emitter_lock;
+
+// Verbose mode: the records of the main loop are formatted and written to
+// stdout by a thread of their own, which may block on a slow journald
+// without holding back any release. Like the emitter, it sleeps on
+// `vlog_fd` with `vlog_waiting` set once the ring is empty.
+static pthread_t vlog_thread;
+static bool vlog_running = false;
+static atomic_bool vlog_stop = false;
+static atomic_bool vlog_waiting = false;
+static int vlog_fd = -1;
 
 // From string_copying manpage
 ssize_t strtcpy(char *restrict dst, const char *restrict src, size_t dsize)
@@ -91,40 +234,54 @@ ssize_t strtcpy(char *restrict dst, const char *restrict src, size_t dsize)
 }
 
 void cleanup() {
-    for (int i = 0; i < device_count; i++) {
-        libevdev_uinput_destroy(uidevs[i]);
-        libevdev_free(output_devs[i]);
-        close(input_fds[i]);
+    // A panic in the emitter thread leaves the cleanup to process exit: the
+    // main thread is still using everything, and closing the uinput fds
+    // destroys the output devices anyway
+    if (emitter_running && pthread_equal(pthread_self(), emitter_thread))
+        return;
+    stop_emitter();
+    free(handoff.slots);
+    free(handoff_tails);
+    handoff.slots = NULL;
+    handoff_tails = NULL;
+    if (wake_fd >= 0)
+        close(wake_fd);
+    if (space_fd >= 0)
+        close(space_fd);
+    wake_fd = space_fd = -1;
+
+    for (int i = 0; i < device_capacity; i++) {
+        if (devices[i].uidev) {
+            release_held_keys(i);
+            libevdev_uinput_destroy(devices[i].uidev);
+        }
+        libevdev_free(devices[i].evdev);
+        if (devices[i].fd >= 0)
+            close(devices[i].fd);
+        free(devices[i].out_events);
+        free(devices[i].held_keys);
+        free(devices[i].path);
     }
+    free(devices);
+    free(out_pending);
+    devices = NULL;
+    out_pending = NULL;
+    device_count = device_capacity = 0;
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    if (timer_fd >= 0)
+        close(timer_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    inotify_fd = timer_fd = epoll_fd = -1;
+    sched_free();
+    rng_wipe();
 }
 
-void sleep_ms(long milliseconds) {
-    struct timespec ts;
-    ts.tv_sec = milliseconds / 1000;
-    ts.tv_nsec = (milliseconds % 1000) * 1000000;
-    if (nanosleep(&ts, NULL) == -1)
-      panic("nanosleep failed: %s", strerror(errno));
-}
-
-long current_time_ms(void) {
+int64_t current_time_ns(void) {
     struct timespec spec;
     clock_gettime(CLOCK_MONOTONIC, &spec);
-    return (spec.tv_sec) * 1000 + (spec.tv_nsec) / 1000000;
-}
-
-long random_between(long lower, long upper) {
-    long maxval;
-    long randval;
-    // default to max if the interval is not valid
-    if (lower >= upper)
-        return upper;
-
-    maxval = upper - lower + 1;
-    if (maxval > UINT32_MAX)
-        return UINT32_MAX;
-
-    randval = randombytes_uniform((uint32_t)maxval);
-    return lower + randval;
+    return (int64_t)spec.tv_sec * NS_PER_SEC + spec.tv_nsec;
 }
 
 void set_rescue_keys(const char* rescue_keys_str) {
@@ -143,6 +300,7 @@ void set_rescue_keys(const char* rescue_keys_str) {
             panic("Invalid key name: '%s'\nSee keycodes.h for valid names", token);
         } else if (rescue_len < MAX_RESCUE_KEYS) {
             rescue_keys[rescue_len] = keycode;
+            rescue_mask[KEY_BIT_WORD(keycode)] |= KEY_BIT_MASK(keycode);
             rescue_len++;
         } else {
             panic("Cannot set more than %d rescue keys", MAX_RESCUE_KEYS);
@@ -152,174 +310,1352 @@ void set_rescue_keys(const char* rescue_keys_str) {
     free(_rescue_keys_str);
 }
 
+// The helpers querying a device return -1 if the ioctl fails, e.g. for a
+// device unplugged right after it appeared; such a device is skipped.
 int supports_event_type(int device_fd, int event_type) {
     unsigned long evbit = 0;
     // Get the bit field of available event types.
     if (ioctl(device_fd, EVIOCGBIT(0, sizeof(evbit)), &evbit) == -1)
-      panic("ioctl EVIOCGBIT failed: %s", strerror(errno));
+        return -1;
     // NOTE: EVIOCGBIT ioctl returns an int, see handle_eviocgbit function in
     // linux/drivers/input/evdev.c, thus this cast is safe
     return (int)evbit & (1 << event_type);
 }
 
-int supports_specific_key(int device_fd, unsigned int key) {
-    size_t nchar = KEY_MAX/8 + 1;
-    unsigned char bits[nchar];
-    // Get the bit fields of available keys.
-    if (ioctl(device_fd, EVIOCGBIT(EV_KEY, sizeof(bits)), &bits) == -1)
-      panic("ioctl EVIOCGBIT for EV_KEY failed: %s", strerror(errno));
-    return bits[key/8] & (1 << (key % 8));
+int count_supported_keys(int device_fd) {
+    unsigned long bits[KEY_BITMAP_WORDS] = { 0 };
+    int count = 0;
+    // Get the bit fields of available keys, all of them in one ioctl
+    if (ioctl(device_fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits) == -1)
+        return -1;
+    for (size_t i = 0; i < sizeof(bits) / sizeof(bits[0]); i++) {
+        count += __builtin_popcountl(bits[i]);
+    }
+    return count;
 }
 
 int is_keyboard(int fd) {
-    unsigned int key;
-    int num_supported_keys = 0;
-
-    // Only check devices that support EV_KEY events
-    if (supports_event_type(fd, EV_KEY)) {
-        // Count the number of KEY_* events that are supported
-        for (key = 0; key <= KEY_MAX; key++) {
-            if (supports_specific_key(fd, key)) {
-                num_supported_keys += 1;
-            }
-        }
-    }
+    int supported, keys;
 
-    return (num_supported_keys > MIN_KEYBOARD_KEYS);
+    // Only count the keys of devices that support EV_KEY events
+    if ((supported = supports_event_type(fd, EV_KEY)) <= 0)
+        return supported;
+    if ((keys = count_supported_keys(fd)) < 0)
+        return -1;
+
+    return device_class_of(keys) == DEVICE_KEYBOARD;
 }
 
 int is_mouse(int fd) {
-    return (supports_event_type(fd, EV_REL) || supports_event_type(fd, EV_ABS));
+    unsigned long evbit = 0;
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(evbit)), &evbit) == -1)
+        return -1;
+    return (evbit & ((1UL << EV_REL) | (1UL << EV_ABS))) != 0;
+}
+
+// Gets the bitmap of the codes of event type `type` the device supports
+// and returns how many there are
+int supported_codes(int fd, unsigned int type, unsigned long *bits, size_t size) {
+    int count = 0;
+
+    memset(bits, 0, size);
+    if (ioctl(fd, EVIOCGBIT(type, size), bits) == -1)
+        return 0;
+    for (size_t i = 0; i < size / sizeof(unsigned long); i++) {
+        count += __builtin_popcountl(bits[i]);
+    }
+    return count;
+}
+
+// How many events to read from the device per wakeup before the other
+// devices and due releases get their turn: a few of the largest reports
+// it can send. A keyboard report is a scan code, a key and a SYN_REPORT;
+// a touchpad or tablet can send every axis, and every multitouch axis
+// once per slot, in a single report.
+unsigned int read_batch_size(int fd) {
+    unsigned long bits[KEY_BITMAP_WORDS];
+    struct input_absinfo slots = { 0 };
+    int frame = 1, abs, mt = 0;
+
+    frame += supported_codes(fd, EV_REL, bits, sizeof(bits));
+    frame += supported_codes(fd, EV_MSC, bits, sizeof(bits));
+    if (supported_codes(fd, EV_KEY, bits, sizeof(bits)) > 0)
+        frame += 2;     // a report rarely changes more than a couple of keys
+
+    abs = supported_codes(fd, EV_ABS, bits, sizeof(bits));
+    for (unsigned int code = ABS_MT_SLOT + 1; code <= ABS_MAX; code++) {
+        if (bits[code / BITS_PER_LONG] & (1UL << (code % BITS_PER_LONG)))
+            mt++;
+    }
+    if (mt > 0 && ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &slots) == 0 && slots.maximum > 0)
+        frame += abs - mt - 1 + (slots.maximum + 1) * (mt + 1);     // ABS_MT_SLOT once per slot
+    else
+        frame += abs;
+
+    return (unsigned int)min(max(frame * READ_BATCH_FRAMES, READ_BATCH_MIN), READ_BATCH_MAX);
+}
+
+// Devices created by kloak itself carry this suffix in their name, except
+// under Qubes, see init_output()
+int is_kloak_device(int fd) {
+    char name[BUFSIZE] = "";
+    const char *suffix = " kloak";
+    size_t len;
+
+    if (ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name) < 0)
+        return 0;
+    len = strlen(name);
+    return len >= strlen(suffix) && strcmp(name + len - strlen(suffix), suffix) == 0;
+}
+
+// Grows the device table, and the arrays indexed by device slot along
+// with it, to hold at least `capacity` devices
+void device_table_grow(int capacity) {
+    struct device *new_devices;
+    int *new_pending;
+    int64_t *new_tails;
+    int new_capacity = device_capacity ? device_capacity : DEVICE_TABLE_INITIAL;
+
+    while (new_capacity < capacity)
+        new_capacity *= 2;
+    if (new_capacity == device_capacity)
+        return;
+
+    new_devices = realloc(devices, (size_t)new_capacity * sizeof(*devices));
+    if (new_devices == NULL)
+        panic("Failed to allocate memory for the device table");
+    devices = new_devices;
+    new_pending = realloc(out_pending, (size_t)new_capacity * sizeof(*out_pending));
+    if (new_pending == NULL)
+        panic("Failed to allocate memory for the device table");
+    out_pending = new_pending;
+    if (handoff_tails != NULL) {
+        new_tails = realloc(handoff_tails, (size_t)new_capacity * sizeof(*handoff_tails));
+        if (new_tails == NULL)
+            panic("Failed to allocate memory for the device table");
+        handoff_tails = new_tails;
+        for (int i = device_capacity; i < new_capacity; i++)
+            handoff_tails[i] = -1;
+    }
+
+    for (int i = device_capacity; i < new_capacity; i++) {
+        devices[i] = (struct device){ .fd = -1 };
+    }
+    device_capacity = new_capacity;
+}
+
+// Puts the device at `path` into a free slot, without opening it yet.
+// Returns the slot.
+int device_table_add(const char *path) {
+    int slot = 0;
+
+    while (slot < device_count && devices[slot].path != NULL)
+        slot++;
+    if (slot >= device_capacity)
+        device_table_grow(slot + 1);
+
+    // slots keep their buffers when they are reused
+    if (devices[slot].out_events == NULL)
+        devices[slot].out_events = calloc(WRITE_BATCH_SIZE, sizeof(struct input_event));
+    if (devices[slot].held_keys == NULL)
+        devices[slot].held_keys = calloc(KEY_BITMAP_WORDS, sizeof(unsigned long));
+    devices[slot].path = strdup(path);
+    if (devices[slot].out_events == NULL || devices[slot].held_keys == NULL
+        || devices[slot].path == NULL)
+        panic("Failed to allocate memory for device: %s", path);
+
+    if (slot == device_count)
+        device_count++;
+    return slot;
+}
+
+// Frees the slot of a device that has been closed, to be reused by the
+// next device added
+void device_table_remove(int slot) {
+    free(devices[slot].path);
+    devices[slot].path = NULL;
+    devices[slot].fd = -1;
+}
+
+// Only evdev nodes are scanned, the legacy mouseN and jsN interfaces
+// are the same devices again
+int is_event_node(const struct dirent *entry) {
+    return strncmp(entry->d_name, "event", 5) == 0;
 }
 
 void detect_devices() {
     int fd;
-    char device[BUFSIZE];
+    int count;
+    char device[PATH_MAX];
+    struct dirent **entries;
+
+    if ((count = scandir("/dev/input", &entries, is_event_node, versionsort)) < 0)
+        panic("Could not list /dev/input: %s", strerror(errno));
 
-    for (int i = 0; i < MAX_DEVICES; i++) {
-        snprintf(device, sizeof(device), "/dev/input/event%d", i);
+    for (int i = 0; i < count; i++) {
+        snprintf(device, sizeof(device), "/dev/input/%s", entries[i]->d_name);
+        free(entries[i]);
 
         if ((fd = open(device, O_RDONLY)) < 0) {
             continue;
         }
 
-        if (is_keyboard(fd)) {
-            strtcpy(named_inputs[device_count++], device, BUFSIZE);
+        if (is_kloak_device(fd)) {
+            // left over from a previous instance, never read our own output
+        } else if (is_keyboard(fd) > 0) {
+            device_table_add(device);
             if (verbose)
                 printf("Found keyboard at: %s\n", device);
-        } else if (is_mouse(fd)) {
-            strtcpy(named_inputs[device_count++], device, BUFSIZE);
+        } else if (is_mouse(fd) > 0) {
+            device_table_add(device);
             if (verbose)
                 printf("Found mouse at: %s\n", device);
         }
 
         if (close(fd) == -1)
           panic("close failed on device: %s, error: %s", device, strerror(errno));
+    }
+    free(entries);
+}
 
-        if (device_count >= MAX_INPUTS) {
-            if (verbose)
-                printf("Warning: ran out of inputs while detecting devices\n");
+// Adds the keys held down on the device to `held`. Returns whether any are.
+int keys_held(int fd, unsigned long *held) {
+    unsigned long bits[KEY_BITMAP_WORDS] = { 0 };
+    unsigned long any = 0;
+    if (ioctl(fd, EVIOCGKEY(sizeof(bits)), bits) == -1)
+      panic("ioctl EVIOCGKEY failed: %s", strerror(errno));
+    for (size_t i = 0; i < KEY_BITMAP_WORDS; i++) {
+        held[i] |= bits[i];
+        any |= bits[i];
+    }
+    return any != 0;
+}
+
+// Tracks the keys held on the input devices. Returns whether ev completes
+// the rescue combination.
+bool rescue_pressed(const struct input_event *ev) {
+    size_t word;
+
+    if (ev->type != EV_KEY || ev->code > KEY_MAX)
+        return false;
+
+    word = KEY_BIT_WORD(ev->code);
+    if (ev->value == 0) {
+        keys_down[word] &= ~KEY_BIT_MASK(ev->code);
+        return false;
+    }
+    keys_down[word] |= KEY_BIT_MASK(ev->code);
+
+    // only a press of one of the rescue keys can complete the combination
+    if (!(rescue_mask[word] & KEY_BIT_MASK(ev->code)))
+        return false;
+    for (size_t i = 0; i < KEY_BITMAP_WORDS; i++) {
+        if ((keys_down[i] & rescue_mask[i]) != rescue_mask[i])
+            return false;
+    }
+    return true;
+}
+
+// Waits until no key is held down on any input device, so that no key is
+// left "held down" when the devices are grabbed, but no longer than
+// timeout_ms. Returns the time waited in milliseconds.
+long wait_for_key_release(int timeout_ms) {
+    int64_t start = current_time_ns();
+    int64_t deadline = start + (int64_t)timeout_ms * NS_PER_MS;
+    int64_t now = start;
+    struct input_event evs[READ_BATCH_SIZE];
+    struct epoll_event ready[EPOLL_BATCH_SIZE];
+    struct epoll_event ev = { .events = EPOLLIN };
+    int wait_fd, nready;
+    bool held;
+
+    // Watch only the devices: the /dev/input watch is already in the main
+    // epoll set, and a hotplug event nobody reads here would wake every
+    // epoll_wait() until the deadline
+    if ((wait_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        panic("epoll_create1 failed: %s", strerror(errno));
+    for (int i = 0; i < device_count; i++) {
+        ev.data.u32 = (uint32_t)i;
+        if (epoll_ctl(wait_fd, EPOLL_CTL_ADD, devices[i].fd, &ev) < 0)
+            panic("epoll_ctl failed: %s", strerror(errno));
+    }
+
+    while (now < deadline) {
+        // the last state read also seeds the rescue key tracking, in case
+        // keys are still held when the wait times out
+        held = false;
+        memset(keys_down, 0, sizeof(keys_down));
+        for (int i = 0; i < device_count; i++) {
+            held |= keys_held(devices[i].fd, keys_down);
+        }
+        if (!held)
             break;
+
+        // sleep until the key state may have changed
+        nready = epoll_wait(wait_fd, ready, EPOLL_BATCH_SIZE,
+                            (int)((deadline - now + NS_PER_MS - 1) / NS_PER_MS));
+        if (nready < 0 && errno != EINTR)
+            panic("epoll_wait() failed: %s", strerror(errno));
+
+        // the devices are not grabbed yet, so these events have already
+        // been delivered to everyone else; just discard our copy
+        for (int i = 0; i < nready; i++) {
+            while (read(devices[ready[i].data.u32].fd, evs, sizeof(evs)) > 0)
+                ;
         }
+        now = current_time_ns();
     }
+    close(wait_fd);
+
+    return (long)((now - start) / NS_PER_MS);
 }
 
-void init_inputs() {
+void init_epoll() {
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        panic("epoll_create1 failed: %s", strerror(errno));
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        panic("timerfd_create failed: %s", strerror(errno));
+    watch_fd(timer_fd, EPOLL_TIMER);
+}
+
+// Adds fd to the epoll set. Its events are reported with `token`, which is
+// the slot for devices. Closing the fd removes it again.
+void watch_fd(int fd, uint32_t token) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = token };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        panic("epoll_ctl failed: %s", strerror(errno));
+}
+
+// Arms the release timer for the absolute CLOCK_MONOTONIC time `when`, or
+// disarms it if `when` is negative. Rearming also clears an expiration
+// that was not read yet.
+void arm_timer(int64_t when) {
+    struct itimerspec its = { 0 };
+
+    if (when >= 0) {
+        its.it_value.tv_sec = (time_t)(when / NS_PER_SEC);
+        its.it_value.tv_nsec = (long)(when % NS_PER_SEC);
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        panic("timerfd_settime failed: %s", strerror(errno));
+}
+
+// Adds slot i to the scheduler with its class and resets its state
+void init_slot(int i, enum device_class class) {
+    memset(devices[i].held_keys, 0, KEY_BITMAP_WORDS * sizeof(unsigned long));
+    if (sched_add_source(i, class) < 0)
+        panic("Failed to allocate memory for the scheduler of device: %s", devices[i].path);
+}
+
+// Opens the device at `path` in nonblocking mode, and with kernel_time has
+// it stamp events with the scheduler's clock. Returns the fd or -1.
+int open_device(const char *path) {
     int fd;
     int one = 1;
+    clockid_t clock_id = CLOCK_MONOTONIC;
 
-    for (int i = 0; i < device_count; i++) {
-        if ((fd = open(named_inputs[i], O_RDONLY)) < 0)
-            panic("Could not open: %s", named_inputs[i]);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (ioctl(fd, FIONBIO, &one) < 0
+        || (kernel_time && ioctl(fd, EVIOCSCLOCKID, &clock_id) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-        // set the device to nonblocking mode
-        if (ioctl(fd, FIONBIO, &one) < 0)
-            panic("Could set to nonblocking: %s", named_inputs[i]);
+// Starts reading the device opened in slot i: assigns it its class and
+// queue and adds it to the epoll set
+void watch_input(int i, enum device_class class) {
+    devices[i].read_batch = read_batch_size(devices[i].fd);
+    devices[i].read_pending = false;
+    init_slot(i, class);
+    watch_fd(devices[i].fd, (uint32_t)i);
+}
 
-        // grab the input device
-        if (ioctl(fd, EVIOCGRAB, &one) < 0)
-            panic("Could not grab: %s", named_inputs[i]);
+// Opens the device in slot i and assigns it its class and queue
+int open_input(int i) {
+    int fd, keyboard;
 
-        input_fds[i] = fd;
+    if ((fd = open_device(devices[i].path)) < 0)
+        return -1;
+    if ((keyboard = is_keyboard(fd)) < 0) {
+        close(fd);
+        return -1;
     }
+
+    devices[i].fd = fd;
+    watch_input(i, keyboard ? DEVICE_KEYBOARD : DEVICE_POINTER);
+    return 0;
 }
 
-void init_outputs() {
+// Grabs the device in slot i, so that only kloak sees its events from now
+// on. Returns -1 if that fails.
+int grab_input(int i) {
+    struct input_event evs[READ_BATCH_SIZE];
+    ssize_t len;
+    int one = 1;
+
+    if (ioctl(devices[i].fd, EVIOCGRAB, &one) < 0)
+        return -1;
+    // Whatever the device queued before was delivered to everyone else as
+    // well; replaying it would type it twice, so empty the kernel buffer
+    // now. The rescue keys are still tracked through these events.
+    while ((len = read(devices[i].fd, evs, sizeof(evs))) > 0) {
+        for (size_t j = 0; j < (size_t)len / sizeof(evs[0]); j++) {
+            if (!persistent_mode() && rescue_pressed(&evs[j]))
+                interrupt = 1;
+        }
+    }
+    return 0;
+}
+
+void init_inputs() {
+    long waited;
+    int64_t t = current_time_ns();
+
+    for (int i = 0; i < device_count; i++) {
+        if (open_input(i) < 0)
+            panic("Could not open: %s", devices[i].path);
+    }
+    startup_ns[STARTUP_OPEN] = current_time_ns() - t;
+    t += startup_ns[STARTUP_OPEN];
+
+    // wait for pending events to finish, avoids keys being "held down"
+    printf("Waiting up to %d ms for keys to be released...\n", startup_timeout);
+    waited = wait_for_key_release(startup_timeout);
+    if (verbose)
+        printf("Waited %ld ms for keys to be released\n", waited);
+    startup_ns[STARTUP_WAIT] = current_time_ns() - t;
+    t += startup_ns[STARTUP_WAIT];
+
+    for (int i = 0; i < device_count; i++) {
+        if (grab_input(i) < 0)
+            panic("Could not grab: %s", devices[i].path);
+    }
+    grabbed_at = current_time_ns();
+    startup_ns[STARTUP_GRAB] = grabbed_at - t;
+}
+
+// Creates the uinput device that replays the events of slot i. Returns 0
+// on success or a negative errno.
+int init_output(int i) {
     char *name;
     const char *suffix = " kloak";
+    int err = libevdev_new_from_fd(devices[i].fd, &devices[i].evdev);
+
+    if (err != 0)
+        return err;
+
+    // Setting the device name under Qubes is pointless, as a Qubes VM
+    // will never have a dynamically changing number of input devices like
+    // a normal VM or a physical system. Furthermore, setting the device
+    // name causes an alarming "Denied qubes.InputKeyboard from vm to
+    // dom0" notification.
+    if (!is_qubes_vm) {
+        const char *tmp_name = libevdev_get_name(devices[i].evdev);
+        name = malloc(strlen(tmp_name) + strlen(suffix) + 1);
+        if (name == NULL)
+            panic("Could not allocate memory for device name: %s", tmp_name);
+
+        strcpy(name, tmp_name);
+        strcat(name, suffix);
+
+        libevdev_set_name(devices[i].evdev, name);
+
+        free(name);
+    }
+
+    err = libevdev_uinput_create_from_device(devices[i].evdev, LIBEVDEV_UINPUT_OPEN_MANAGED, &devices[i].uidev);
+    if (err != 0) {
+        libevdev_free(devices[i].evdev);
+        devices[i].evdev = NULL;
+    }
+    return err;
+}
+
+void init_outputs() {
+    int64_t t = current_time_ns();
+
     for (int i = 0; i < device_count; i++) {
-        int err = libevdev_new_from_fd(input_fds[i], &output_devs[i]);
+        if (init_output(i) != 0)
+            panic("Could not create uidev for input device: %s", devices[i].path);
+    }
+    startup_ns[STARTUP_OUTPUTS] = current_time_ns() - t;
+}
 
-        if (err != 0)
-            panic("Could not create evdev for input device: %s", named_inputs[i]);
+// Watches /dev/input so that devices plugged in later are picked up
+// without restarting. Must be set up before detect_devices(), so that no
+// device can appear unnoticed in between.
+void init_hotplug() {
+    if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+        panic("inotify_init1 failed: %s", strerror(errno));
+    if (inotify_add_watch(inotify_fd, "/dev/input", IN_CREATE) < 0)
+        panic("Could not watch /dev/input: %s", strerror(errno));
+    watch_fd(inotify_fd, EPOLL_HOTPLUG);
+}
+
+// Starts reading from a device that appeared while running. It only gets
+// a scheduler source and an epoll registration once it is known to be a
+// keyboard or mouse and has been taken over, so a device that is rejected
+// or fails has nothing there to tear down.
+void add_device(const char *device) {
+    int slot, fd, keyboard = 0, mouse = 0;
+    const char *node;
 
-        // Setting the device name under Qubes is pointless, as a Qubes VM
-        // will never have a dynamically changing number of input devices like
-        // a normal VM or a physical system. Furthermore, setting the device
-        // name causes an alarming "Denied qubes.InputKeyboard from vm to
-        // dom0" notification.
-        if (!is_qubes_vm) {
-            const char *tmp_name = libevdev_get_name(output_devs[i]);
-            name = malloc(strlen(tmp_name) + strlen(suffix) + 1);
-            if (name == NULL)
-                panic("Could not allocate memory for device name: %s", tmp_name);
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].fd < 0)
+            continue;
+        // our own output devices show up here as well
+        node = libevdev_uinput_get_devnode(devices[i].uidev);
+        if (strcmp(devices[i].path, device) == 0 || (node && strcmp(node, device) == 0))
+            return;
+    }
 
-            strcpy(name, tmp_name);
-            strcat(name, suffix);
+    if ((fd = open_device(device)) < 0)
+        return;
+    if (is_kloak_device(fd) || (keyboard = is_keyboard(fd)) < 0
+        || (!keyboard && (mouse = is_mouse(fd)) <= 0)) {
+        if (keyboard < 0 || mouse < 0)
+            fprintf(stderr, "Could not query hotplugged device: %s\n", device);
+        close(fd);
+        return;
+    }
 
-            libevdev_set_name(output_devs[i], name);
+    // the emitter only uses the slot once its events are handed off, but
+    // the table may move under it
+    lock_emitter();
+    slot = device_table_add(device);
+    unlock_emitter();
+    devices[slot].fd = fd;
+    if (grab_input(slot) < 0 || init_output(slot) != 0) {
+        fprintf(stderr, "Could not take over hotplugged device: %s\n", device);
+        close(fd);
+        device_table_remove(slot);
+        return;
+    }
+    lock_emitter();
+    watch_input(slot, keyboard ? DEVICE_KEYBOARD : DEVICE_POINTER);
+    unlock_emitter();
+
+    printf("Added device: %s\n", device);
+}
+
+// Stops reading from a device that was unplugged. Its buffered events are
+// dropped, so the keys they would have released are released right away.
+void remove_device(int i) {
+    if (devices[i].read_pending) {
+        devices[i].read_pending = false;
+        read_backlog--;
+    }
 
-            free(name);
+    // In threaded mode the queues and the uinput device belong to the
+    // emitter thread. With it held off, what the device still has in the
+    // handoff ring is queued first, so that dropping its events leaves
+    // none behind to be released on the device that reuses the slot.
+    lock_emitter();
+    if (emitter_running)
+        drain_handoff(current_time_ns());
+    sched_remove_source(i);
+    devices[i].out_count = 0;
+    release_held_keys(i);
+    unlock_emitter();
+    // the other devices' events just queued may be due before its wakeup
+    if (emitter_running)
+        wake_emitter();
+
+    libevdev_uinput_destroy(devices[i].uidev);
+    libevdev_free(devices[i].evdev);
+    close(devices[i].fd);
+    devices[i].uidev = NULL;
+    devices[i].evdev = NULL;
+
+    printf("Removed device: %s\n", devices[i].path);
+    device_table_remove(i);
+
+    // without hotplug no device can come back, so there is nothing left to do
+    if (!hotplug) {
+        for (int j = 0; j < device_count; j++) {
+            if (devices[j].fd >= 0)
+                return;
         }
+        printf("All input devices are gone, exiting\n");
+        interrupt = 1;
+    }
+}
+
+void handle_hotplug() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char device[BUFSIZE];
+    const struct inotify_event *ie;
+    ssize_t len;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ie->len) {
+            ie = (const struct inotify_event *)p;
+            if (ie->len == 0 || strncmp(ie->name, "event", 5) != 0)
+                continue;
+            snprintf(device, sizeof(device), "/dev/input/%s", ie->name);
+            add_device(device);
+        }
+    }
+}
 
-        err = libevdev_uinput_create_from_device(output_devs[i], LIBEVDEV_UINPUT_OPEN_MANAGED, &uidevs[i]);
+// Releases every key that is still held on the uinput device of slot i,
+// whose press was forwarded but whose release is lost with the queue.
+// Errors are ignored, this runs on the way out.
+void release_held_keys(int i) {
+    struct input_event *out = devices[i].out_events;
+    unsigned int n = 0;
+    int fd = libevdev_uinput_get_fd(devices[i].uidev);
 
-        if (err != 0)
-            panic("Could not create uidev for input device: %s", named_inputs[i]);
+    for (unsigned int code = 0; code <= KEY_MAX; code++) {
+        if (!(devices[i].held_keys[KEY_BIT_WORD(code)] & KEY_BIT_MASK(code)))
+            continue;
+        out[n++] = (struct input_event){ .type = EV_KEY, .code = (__u16)code, .value = 0 };
+        if (n == WRITE_BATCH_SIZE - 1) {
+            out[n++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT };
+            if (write(fd, out, n * sizeof(*out)) < 0)
+                return;
+            n = 0;
+        }
+    }
+    if (n > 0) {
+        out[n++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT };
+        if (write(fd, out, n * sizeof(*out)) < 0)
+            return;
     }
+    memset(devices[i].held_keys, 0, KEY_BITMAP_WORDS * sizeof(unsigned long));
 }
 
-void emit_event(struct entry *e) {
-    int res, delay;
-    long now = current_time_ms();
-    delay = (int) (e->time - now);
+void flush_device(int device_index) {
+    ssize_t res;
+    size_t len = devices[device_index].out_count * sizeof(struct input_event);
 
-    res = libevdev_uinput_write_event(uidevs[e->device_index], e->iev.type, e->iev.code, e->iev.value);
-    if (res != 0) {
-        panic("Failed to write event to uinput: %s", strerror(-res));
+    // uinput consumes whole events and the kernel stamps them itself, so
+    // one write() forwards the batch exactly as libevdev would one by one
+    res = write(libevdev_uinput_get_fd(devices[device_index].uidev), devices[device_index].out_events, len);
+    if (res < 0)
+        panic("Failed to write events to uinput: %s", strerror(errno));
+    if ((size_t)res != len)
+        panic("Short write to uinput: %zd of %zu bytes", res, len);
+
+    devices[device_index].out_count = 0;
+}
+
+void flush_events() {
+    for (unsigned int i = 0; i < out_pending_count; i++) {
+        if (devices[out_pending[i]].out_count > 0)
+            flush_device(out_pending[i]);
+    }
+    out_pending_count = 0;
+}
+
+// The scheduler's emit callback. The event is staged for its uinput
+// device and written out together with the other events due at the same
+// time by flush_events()
+void emit_event(const struct entry *e, int64_t now) {
+    int d = e->device_index;
+
+    if (devices[d].out_count == 0)
+        out_pending[out_pending_count++] = d;
+    else if (devices[d].out_count == WRITE_BATCH_SIZE)
+        flush_device(d);
+    devices[d].out_events[devices[d].out_count++] = e->iev;
+
+    if (e->iev.type == EV_KEY && e->iev.code <= KEY_MAX) {
+        if (e->iev.value == 0)
+            devices[d].held_keys[KEY_BIT_WORD(e->iev.code)] &= ~KEY_BIT_MASK(e->iev.code);
+        else
+            devices[d].held_keys[KEY_BIT_WORD(e->iev.code)] |= KEY_BIT_MASK(e->iev.code);
     }
 
-    if (verbose) {
-        printf("Released event at time : %ld. Device: %d,  Type: %*d,  "
-               "Code: %*d,  Value: %*d,  Missed target:  %*d ms \n",
-               e->time, e->device_index, 3, e->iev.type, 5, e->iev.code, 5, e->iev.value, 5, delay);
+    // in threaded mode this is the emitter thread, and the verbose log
+    // belongs to the main thread
+    if (verbose_mode() && !threaded) {
+        vlog_record(VLOG_RELEASED, e->time, d, e->iev.type, e->iev.code, e->iev.value, e->time - now);
     }
 }
 
-void main_loop() {
-    long int err;
-    long prev_release_time = 0;
-    long current_time = 0;
-    long lower_bound = 0;
-    long random_delay = 0;
-    struct input_event ev;
-    struct entry *n1, *np;
+// Releases every buffered event that is due at `now`. Returns the release
+// time of the next buffered event, or -1 if all queues are empty.
+int64_t release_due_events(int64_t now) {
+    int64_t next = sched_release_due(now);
+
+    flush_events();
+    return next;
+}
+
+void spsc_init(struct spsc_ring *r, size_t capacity) {
+    r->slots = calloc(capacity, sizeof(struct entry));
+    if (r->slots == NULL)
+        panic("Failed to allocate memory for the handoff ring");
+    r->capacity = capacity;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+}
+
+// Producer side. Returns false if the ring is full.
+bool spsc_push(struct spsc_ring *r, const struct entry *e) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&r->head, memory_order_acquire) == r->capacity)
+        return false;
+    r->slots[tail & (r->capacity - 1)] = *e;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Consumer side. Returns false if the ring is empty.
+bool spsc_pop(struct spsc_ring *r, struct entry *e) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(&r->tail, memory_order_acquire))
+        return false;
+    *e = r->slots[head & (r->capacity - 1)];
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return true;
+}
+
+size_t spsc_count(struct spsc_ring *r) {
+    return atomic_load_explicit(&r->tail, memory_order_acquire)
+           - atomic_load_explicit(&r->head, memory_order_acquire);
+}
 
-    // initialize the rescue state
-    int rescue_state[MAX_RESCUE_KEYS];
-    for (int i = 0; i < rescue_len; i++) {
-        rescue_state[i] = 0;
+void wake_emitter() {
+    uint64_t one = 1;
+
+    // pairs with the fence in emitter_main(): either the emitter sees the
+    // new entries before sleeping, or we see that it is about to sleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&emitter_waiting, memory_order_relaxed)) {
+        if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            panic("write() to the emitter failed: %s", strerror(errno));
+    }
+}
+
+// Reader side of threaded mode: schedules the event and hands it to the
+// emitter thread. Coalescing is not available, it needs the queues.
+void handoff_event(int k, const struct input_event *ev, int64_t now) {
+    int queue = sched_queue_of(k);
+    int64_t lower_bound;
+    struct entry e;
+
+    e.time = now + sched_delay(k, ev, now, handoff_tails[queue], &lower_bound);
+    e.arrival = now;
+    e.iev = *ev;
+    e.device_index = k;
+    handoff_tails[queue] = e.time;
+
+    stats_record_buffered(sched_stats(k), now, e.time - now, spsc_count(&handoff));
+
+    // the emitter empties the ring whenever it wakes up, so it is only
+    // full for as long as the emitter is busy releasing
+    while (!spsc_push(&handoff, &e))
+        wait_for_space();
+
+    if (verbose_mode()) {
+        vlog_record(VLOG_BUFFERED, e.time, k, ev->type, ev->code, ev->value, e.time - now);
+        if (lower_bound > 0) {
+            vlog_record(VLOG_LOWER_BOUND, e.time, k, 0, 0, 0, lower_bound);
+        }
+    }
+}
+
+// Reader side: sleeps until the emitter has taken entries off the full
+// handoff ring. Like the emitter's own sleep, either the emitter sees
+// reader_waiting after making room, or we see the room before sleeping.
+void wait_for_space() {
+    struct pollfd pfd = { .fd = space_fd, .events = POLLIN };
+    uint64_t wakeups;
+
+    atomic_store(&reader_waiting, true);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (spsc_count(&handoff) < handoff.capacity) {
+        atomic_store(&reader_waiting, false);
+        return;
+    }
+    wake_emitter();
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        panic("poll() failed waiting for the emitter: %s", strerror(errno));
+    atomic_store(&reader_waiting, false);
+    if (pfd.revents & POLLIN) {
+        if (read(space_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+            panic("read() failed waiting for the emitter: %s", strerror(errno));
+    }
+}
+
+// Emitter side: moves the handed off events to their queues, and wakes
+// the reader if it is waiting for room
+void drain_handoff(int64_t now) {
+    struct entry e;
+    uint64_t one = 1;
+    bool drained = false;
+
+    while (spsc_pop(&handoff, &e)) {
+        sched_insert(&e, now);
+        drained = true;
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (drained && atomic_load_explicit(&reader_waiting, memory_order_relaxed)) {
+        if (write(space_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            panic("write() to the reader failed: %s", strerror(errno));
+    }
+}
+
+void lock_emitter() {
+    if (emitter_running)
+        pthread_mutex_lock(&emitter_lock);
+}
+
+void unlock_emitter() {
+    if (emitter_running)
+        pthread_mutex_unlock(&emitter_lock);
+}
+
+void *emitter_main(void *arg) {
+    struct sched_param param = { .sched_priority = rt_priority };
+    struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+    struct timespec timeout, *timeout_ptr;
+    int64_t now, next;
+    uint64_t wakeups;
+    int err;
+
+    // the timer slack is per thread, see main_loop()
+    if (prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL) == -1)
+        panic("prctl PR_SET_TIMERSLACK failed: %s", strerror(errno));
+    if (rt_priority > 0 && (err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+        fprintf(stderr, "Could not set SCHED_FIFO priority %d for the emitter: %s\n",
+                rt_priority, strerror(err));
+
+    while (!atomic_load(&emitter_stop)) {
+        pthread_mutex_lock(&emitter_lock);
+        now = current_time_ns();
+        drain_handoff(now);
+        next = release_due_events(now);
+        pthread_mutex_unlock(&emitter_lock);
+
+        atomic_store(&emitter_waiting, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (spsc_count(&handoff) > 0 || atomic_load(&emitter_stop)) {
+            atomic_store(&emitter_waiting, false);
+            continue;
+        }
+
+        // sleep until the next release or until new events are handed off
+        timeout_ptr = NULL;
+        if (next >= 0) {
+            next = max(next - current_time_ns(), 0);
+            timeout.tv_sec = (time_t)(next / NS_PER_SEC);
+            timeout.tv_nsec = (long)(next % NS_PER_SEC);
+            timeout_ptr = &timeout;
+        }
+        if (ppoll(&pfd, 1, timeout_ptr, NULL) < 0 && errno != EINTR)
+            panic("ppoll() failed in the emitter: %s", strerror(errno));
+        atomic_store(&emitter_waiting, false);
+        if (pfd.revents & POLLIN) {
+            if (read(wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+                panic("read() failed in the emitter: %s", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+// Starts the emitter thread. Signals stay blocked in it, so that they are
+// all handled by the main thread.
+void start_emitter() {
+    pthread_attr_t attr;
+    pthread_mutexattr_t lock_attr;
+    sigset_t all, old;
+    int capacity, err;
+
+    spsc_init(&handoff, QUEUE_CAPACITY);
+    // grown along with the device table, which is still empty if every
+    // device is to be plugged in later
+    capacity = max(device_capacity, DEVICE_TABLE_INITIAL);
+    handoff_tails = malloc((size_t)capacity * sizeof(*handoff_tails));
+    if (handoff_tails == NULL)
+        panic("Failed to allocate memory for the handoff ring");
+    for (int i = 0; i < capacity; i++)
+        handoff_tails[i] = -1;
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+        || (space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        panic("eventfd failed: %s", strerror(errno));
+
+    pthread_mutexattr_init(&lock_attr);
+    pthread_mutexattr_setprotocol(&lock_attr, PTHREAD_PRIO_INHERIT);
+    if ((err = pthread_mutex_init(&emitter_lock, &lock_attr)) != 0)
+        panic("pthread_mutex_init failed: %s", strerror(err));
+    pthread_mutexattr_destroy(&lock_attr);
+
+    // with locked memory the whole stack is faulted in and counts against
+    // RLIMIT_MEMLOCK, so do not give it the default 8 MB
+    pthread_attr_init(&attr);
+    if (lock_memory)
+        pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&emitter_thread, &attr, emitter_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+        panic("Could not start the emitter thread: %s", strerror(err));
+    emitter_running = true;
+}
+
+// Wakes the verbose output thread if it is asleep and there is something
+// to write. The main loop calls this once before it sleeps, for everything
+// recorded since, as it does wake_emitter().
+void wake_vlog() {
+    uint64_t one = 1;
+
+    // pairs with the fence in vlog_main(), as in wake_emitter()
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&vlog_waiting, memory_order_relaxed) && vlog_pending() > 0) {
+        if (write(vlog_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            panic("write() to the verbose output thread failed: %s", strerror(errno));
+    }
+}
+
+// Verbose output thread: writes out the records until told to stop. It
+// runs below everything else, it only has to keep the ring from filling.
+// Errors leave the records to the final flush in stop_vlog(), a panic
+// here would tear down what the main thread is using.
+void *vlog_main(void *arg) {
+    struct sched_param param = { .sched_priority = 0 };
+    struct pollfd pfd = { .fd = vlog_fd, .events = POLLIN };
+    uint64_t wakeups;
+
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    setpriority(PRIO_PROCESS, (id_t)gettid(), 19);
+
+    while (!atomic_load(&vlog_stop)) {
+        if (vlog_flush(STDOUT_FILENO, VLOG_CAPACITY) > 0)
+            continue;
+
+        atomic_store(&vlog_waiting, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (vlog_pending() > 0 || atomic_load(&vlog_stop)) {
+            atomic_store(&vlog_waiting, false);
+            continue;
+        }
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            fprintf(stderr, "poll() failed in the verbose output thread: %s\n", strerror(errno));
+            break;
+        }
+        atomic_store(&vlog_waiting, false);
+        if ((pfd.revents & POLLIN) && read(vlog_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "read() failed in the verbose output thread: %s\n", strerror(errno));
+            break;
+        }
+    }
+    return NULL;
+}
+
+void start_vlog() {
+    pthread_attr_t attr;
+    sigset_t all, old;
+    int err;
+
+    // what stdio holds goes first, the thread writes to the fd directly
+    fflush(stdout);
+    if ((vlog_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        panic("eventfd failed: %s", strerror(errno));
+
+    pthread_attr_init(&attr);
+    if (lock_memory)
+        pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&vlog_thread, &attr, vlog_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+        panic("Could not start the verbose output thread: %s", strerror(err));
+    vlog_running = true;
+}
+
+// Stops the verbose output thread and writes out what is left
+void stop_vlog() {
+    uint64_t one = 1;
+
+    if (vlog_running) {
+        atomic_store(&vlog_stop, true);
+        if (write(vlog_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            panic("write() to the verbose output thread failed: %s", strerror(errno));
+        pthread_join(vlog_thread, NULL);
+        vlog_running = false;
+    }
+    if (vlog_fd >= 0)
+        close(vlog_fd);
+    vlog_fd = -1;
+    fflush(stdout);
+    vlog_flush(STDOUT_FILENO, VLOG_CAPACITY);
+}
+
+void stop_emitter() {
+    if (!emitter_running)
+        return;
+    atomic_store(&emitter_stop, true);
+    wake_emitter();
+    pthread_join(emitter_thread, NULL);
+    emitter_running = false;
+}
+
+// Parses a list of CPUs such as "2" or "0,2-3" into `set`. Returns -1 if
+// the list is malformed or names a CPU that cannot be in a cpu_set_t.
+int parse_cpu_list(const char *list, cpu_set_t *set) {
+    const char *p = list;
+    char *end;
+    long first, last;
+
+    CPU_ZERO(set);
+    do {
+        errno = 0;
+        first = last = strtol(p, &end, 10);
+        if (end == p || errno != 0)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || errno != 0)
+                return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET((size_t)cpu, set);
+        }
+        p = end + 1;
+    } while (*end == ',');
+
+    return *end == '\0' ? 0 : -1;
+}
+
+// Touches the stack the main loop may grow into, so that it is faulted in
+// and locked now rather than on the first deep call while events are due
+void prefault_stack() {
+    volatile unsigned char stack[PREFAULT_STACK_SIZE];
+
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+// Applies the CPU affinity, nice value and memory locking options, once
+// the devices are grabbed and the output devices exist. The emitter thread
+// is started later and inherits all of it. Failing to apply one only
+// costs latency, so kloak warns and keeps running with the devices grabbed.
+void tune_process() {
+    if (affinity_str[0] != '\0' && sched_setaffinity(0, sizeof(affinity), &affinity) == -1)
+        fprintf(stderr, "Could not pin kloak to CPUs %s: %s\n", affinity_str, strerror(errno));
+    if (renice && setpriority(PRIO_PROCESS, 0, nice_level) == -1)
+        fprintf(stderr, "Could not set nice value %d: %s\n", nice_level, strerror(errno));
+
+    if (!lock_memory)
+        return;
+
+    // The queues, the output buffers and the verbose log are all allocated
+    // by now, so MCL_CURRENT faults in and locks the whole event pool.
+    // Memory freed when a device is removed is kept rather than handed back
+    // and faulted in again when the next one is plugged in.
+    mallopt(M_TRIM_THRESHOLD, -1);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        fprintf(stderr, "Could not lock memory: %s\n", strerror(errno));
+        return;
+    }
+    prefault_stack();
+}
+
+// A kloak built with options fixed at build time cannot honour a command
+// line asking for something else, so it refuses to start rather than
+// silently running in another mode.
+void check_build_variant() {
+#ifdef KLOAK_VERBOSE
+    if (verbose != KLOAK_VERBOSE)
+        panic("This kloak was built %s verbose mode, %s -v\n",
+              KLOAK_VERBOSE ? "for" : "without", KLOAK_VERBOSE ? "it needs" : "it does not support");
+#endif
+#ifdef KLOAK_PERSISTENT
+    if (persistent != KLOAK_PERSISTENT)
+        panic("This kloak was built %s persistent mode, %s -p\n",
+              KLOAK_PERSISTENT ? "for" : "without", KLOAK_PERSISTENT ? "it needs" : "it does not support");
+#endif
+#if defined(KLOAK_PER_CLASS) && !KLOAK_PER_CLASS
+    if (max_motion_delay >= 0)
+        panic("This kloak was built without a separate pointer delay, it does not support -m\n");
+#endif
+}
+
+// Configures the scheduler from the options, before any device is added.
+// There is one queue, and so one FIFO lower bound, per group of devices
+// whose events must stay in order: all devices share one unless a separate
+// pointer delay is set, in which case each class gets its own, or
+// independent mode is on, in which case each device gets its own.
+void init_scheduler() {
+    struct sched_config config = {
+        .max_delay_ns = {
+            [DEVICE_KEYBOARD] = (int64_t)max_delay * NS_PER_MS,
+            [DEVICE_POINTER] = (int64_t)(max_motion_delay >= 0 ? max_motion_delay : max_delay) * NS_PER_MS,
+        },
+        .min_adaptive_delay_ns = min_adaptive_delay >= 0 ? (int64_t)min_adaptive_delay * NS_PER_MS : -1,
+        .coalesce_window_ns = (int64_t)coalesce_window * NS_PER_MS,
+        .grouping = independent ? SCHED_PER_SOURCE : max_motion_delay >= 0 ? SCHED_PER_CLASS : SCHED_SHARED,
+        .frames = frames,
+        .verbose = verbose,
+        .emit = emit_event,
+    };
+
+    if (min_adaptive_delay > max_delay)
+        panic("Minimum adaptive delay must not exceed the maximum delay\n");
+    if (sched_init(&config) < 0)
+        panic("Failed to set up the scheduler\n");
+}
+
+// Prints how long each startup phase took, on one line without a newline
+void print_startup(FILE *f) {
+    for (int i = 0; i < STARTUP_PHASE_COUNT; i++) {
+        fprintf(f, "%s%s %.1f ms", i > 0 ? ", " : "", startup_phase_names[i],
+                (double)startup_ns[i] / NS_PER_MS);
+    }
+    fprintf(f, "; input grabbed after %.1f ms", (double)(grabbed_at - process_start) / NS_PER_MS);
+}
+
+// Goes through device detection and output setup `runs` times, tearing
+// everything down in between, and reports how long each phase took. This
+// is what a restart of kloak costs, e.g. when systemd restarts it after a
+// crash or it is restarted by hand. The devices are grabbed briefly on
+// every run.
+void benchmark_startup(int runs) {
+    struct histogram *h;
+    bool autodetect = device_count == 0;
+    int64_t t;
+
+    if ((h = calloc(STARTUP_PHASE_COUNT + 1, sizeof(*h))) == NULL)
+        panic("Failed to allocate memory for the startup benchmark");
+
+    for (int run = 0; run < runs; run++) {
+        t = current_time_ns();
+        if (autodetect)
+            detect_devices();
+        startup_ns[STARTUP_DETECT] = current_time_ns() - t;
+        if (device_count == 0)
+            panic("Unable to find any keyboards or mice\n");
+        init_inputs();
+        init_outputs();
+
+        for (int i = 0; i < STARTUP_PHASE_COUNT; i++)
+            histogram_record(&h[i], startup_ns[i]);
+        // time to grab, the window in which input is unprotected
+        histogram_record(&h[STARTUP_PHASE_COUNT], grabbed_at - t);
+
+        // closing the input releases the grab
+        for (int i = 0; i < device_count; i++) {
+            libevdev_uinput_destroy(devices[i].uidev);
+            libevdev_free(devices[i].evdev);
+            close(devices[i].fd);
+            devices[i].uidev = NULL;
+            devices[i].evdev = NULL;
+            devices[i].fd = -1;
+            if (autodetect)
+                device_table_remove(i);
+        }
+        if (autodetect)
+            device_count = 0;
+    }
+
+    printf("kloak startup benchmark: %d runs\n", runs);
+    printf("%-8s %9s %9s %9s %9s (ms)\n", "phase", "min", "median", "p90", "max");
+    for (int i = 0; i <= STARTUP_PHASE_COUNT; i++) {
+        printf("%-8s %9.2f %9.2f %9.2f %9.2f\n",
+               i < STARTUP_PHASE_COUNT ? startup_phase_names[i] : "to grab",
+               (double)h[i].min / NS_PER_MS, (double)histogram_percentile(&h[i], 0.5) / NS_PER_MS,
+               (double)histogram_percentile(&h[i], 0.9) / NS_PER_MS, (double)h[i].max / NS_PER_MS);
+    }
+    free(h);
+}
+
+void handle_sigusr1(int signal) {
+    stats_requested = 1;
+}
+
+// SIGUSR1 prints the statistics. Its handler is installed before anything
+// else, with the signal blocked until the main loop waits for input: by
+// default it would kill kloak, e.g. when it is sent while kloak restarts.
+void init_signals() {
+    struct sigaction sa;
+    sigset_t usr1_mask;
+
+    sigemptyset(&usr1_mask);
+    sigaddset(&usr1_mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &usr1_mask, NULL) == -1)
+        panic("sigprocmask failed: %s", strerror(errno));
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigusr1;
+    if (sigaction(SIGUSR1, &sa, NULL) == -1)
+        panic("sigaction failed: %s", strerror(errno));
+}
+
+void print_stats(FILE *f, int64_t now) {
+    fprintf(f, "kloak statistics after %.1f s, %lu events released early on queue overflow\n",
+            (double)(now - start_time) / NS_PER_SEC, sched_overflows());
+    fprintf(f, "startup: ");
+    print_startup(f);
+    fprintf(f, "\n");
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].fd >= 0) {
+            stats_print_device(f, devices[i].path, sched_stats(i), now - start_time);
+            fprintf(f, "  read batch %u events\n", devices[i].read_batch);
+        }
+    }
+    if (min_adaptive_delay < 0)
+        return;
+    for (unsigned int i = 0; i < sched_queue_count(); i++) {
+        const struct event_queue *q = sched_queue(i);
+        if (q->press_interval > 0)
+            fprintf(f, "queue %u: key press interval %.1f ms, deviation %.1f ms, adaptive window %.1f ms\n",
+                    i, (double)q->press_interval / NS_PER_MS, (double)q->press_deviation / NS_PER_MS,
+                    (double)sched_adaptive_window(q, sched_queue_max_delay(i)) / NS_PER_MS);
     }
+}
 
-    // load input file descriptors for polling
-    struct pollfd *pfds = calloc(device_count, sizeof(struct pollfd));
-    if (pfds == NULL) {
-        panic("Failed to allocate memory for pollfd array");
+// Replaces the statistics file, through a rename so that readers never see
+// a partially written file
+void write_stats_file(int64_t now) {
+    char tmp_file[BUFSIZE + 4];
+    FILE *f;
+
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", stats_file);
+    if ((f = fopen(tmp_file, "w")) == NULL) {
+        fprintf(stderr, "Could not open statistics file %s: %s\n", tmp_file, strerror(errno));
+        return;
     }
-    for (int j = 0; j < device_count; j++) {
-        pfds[j].fd = input_fds[j];
-        pfds[j].events = POLLIN;
+    print_stats(f, now);
+    if (fclose(f) != 0 || rename(tmp_file, stats_file) != 0)
+        fprintf(stderr, "Could not write statistics file %s: %s\n", stats_file, strerror(errno));
+}
+
+// The time an event arrived. That is when it was read, or with kernel_time
+// when the kernel received it, which can be several ms earlier under load.
+// Events of different devices are read in turns, so kernel timestamps are
+// kept from going backwards, which keeps the FIFO lower bound within the
+// maximum delay.
+int64_t arrival_time(const struct input_event *ev, int64_t now) {
+    int64_t t;
+
+    if (!kernel_time)
+        return now;
+    t = (int64_t)ev->input_event_sec * NS_PER_SEC + (int64_t)ev->input_event_usec * 1000L;
+    last_arrival = max(min(t, now), last_arrival);
+    return last_arrival;
+}
+
+// Reads and schedules everything device k has queued. Events come through
+// libevdev, which reads them from the kernel in batches, so a multi-event
+// report costs one wakeup instead of one per event, and keeps track of the
+// device state. If the kernel buffer overflowed, libevdev reports
+// SYN_DROPPED and discards the incomplete frame; the events it then
+// synthesizes from the difference between the state seen last and the
+// kernel's bring the output device back in sync, so no key stays stuck.
+// At most read_batch events are read per call, outside of a resync, so a
+// flood from one device cannot hold back the others or the due releases;
+// a device with events left is marked read_pending and served again on
+// the next iteration of the main loop.
+void read_device(int k, int64_t now) {
+    struct input_event ev;
+    unsigned int flag = LIBEVDEV_READ_FLAG_NORMAL;
+    unsigned int count = 0;
+    int rc;
+
+    if (devices[k].read_pending) {
+        devices[k].read_pending = false;
+        read_backlog--;
+    }
+    while (1) {
+        if (count >= devices[k].read_batch && flag == LIBEVDEV_READ_FLAG_NORMAL) {
+            // libevdev may hold the rest already, which epoll cannot see
+            devices[k].read_pending = true;
+            read_backlog++;
+            stats_record_read(sched_stats(k), count);
+            return;
+        }
+
+        rc = libevdev_next_event(devices[k].evdev, flag, &ev);
+        if (rc == -EAGAIN && flag == LIBEVDEV_READ_FLAG_SYNC) {
+            // resynced, back to the events as they come
+            flag = LIBEVDEV_READ_FLAG_NORMAL;
+            continue;
+        }
+        if (rc == -EAGAIN) {
+            stats_record_read(sched_stats(k), count);
+            return;
+        }
+        if (rc == -ENODEV) {
+            remove_device(k);
+            return;
+        }
+        if (rc < 0)
+            panic("Reading from %s failed: %s", devices[k].path, strerror(-rc));
+
+        if (rc == LIBEVDEV_READ_STATUS_SYNC && flag == LIBEVDEV_READ_FLAG_NORMAL) {
+            // the SYN_DROPPED itself is not forwarded, the sync events replace it
+            stats_record_drop(sched_stats(k));
+            if (verbose_mode())
+                vlog_record(VLOG_DROPPED, now, k, 0, 0, 0, 0);
+            flag = LIBEVDEV_READ_FLAG_SYNC;
+            continue;
+        }
+
+        count++;
+
+        // check for the rescue sequence.
+        if (!persistent_mode() && rescue_pressed(&ev))
+            interrupt = 1;
+
+        if (threaded)
+            handoff_event(k, &ev, arrival_time(&ev, now));
+        else
+            sched_schedule(k, &ev, arrival_time(&ev, now));
     }
+}
+
+void main_loop() {
+    int64_t current_time = 0;
+    int64_t next_release = -1;
+    int64_t next_stats = -1;
+    int64_t armed = -1;
+    int timeout;
+    int nready;
+    struct sched_param param = { .sched_priority = rt_priority };
+    int err;
+    sigset_t wait_mask;
+    struct epoll_event ready[EPOLL_BATCH_SIZE];
+
+    // timer expirations are stretched by the timer slack (50 us by default),
+    // which would show up as missed release targets
+    if (prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL) == -1)
+        panic("prctl PR_SET_TIMERSLACK failed: %s", strerror(errno));
+
+    // without the emitter thread, this loop releases the events
+    if (rt_priority > 0 && !threaded
+        && (err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+        fprintf(stderr, "Could not set SCHED_FIFO priority %d for the main loop: %s\n",
+                rt_priority, strerror(err));
+
+    // SIGUSR1 is only let through while waiting in epoll_pwait(), so a
+    // request can never slip in between the checks below. One sent while
+    // starting up has been pending since, see init_signals().
+    if (sigprocmask(SIG_BLOCK, NULL, &wait_mask) == -1)
+        panic("sigprocmask failed: %s", strerror(errno));
+    sigdelset(&wait_mask, SIGUSR1);
+
+    start_time = current_time_ns();
+    if (stats_file[0] != '\0')
+        next_stats = start_time + (int64_t)stats_interval * NS_PER_SEC;
 
     // the main loop breaks when the rescue keys are detected
     // On each iteration, wait for input from the input devices
@@ -329,84 +1665,89 @@ void main_loop() {
     // so that events are always scheduled in the order they
     // arrive (FIFO).
     while (!interrupt) {
-        // Emit any events exceeding the current time
-        current_time = current_time_ms();
-        while ((np = TAILQ_FIRST(&head)) && (current_time >= np->time)) {
-            emit_event(np);
-            TAILQ_REMOVE(&head, np, entries);
-            free(np);
+        // Emit any events exceeding the current time, unless the emitter
+        // thread does
+        current_time = current_time_ns();
+        next_release = threaded ? -1 : release_due_events(current_time);
+
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats(stdout, current_time);
+            fflush(stdout);
         }
+        if (next_stats >= 0 && current_time >= next_stats) {
+            write_stats_file(current_time);
+            next_stats = current_time + (int64_t)stats_interval * NS_PER_SEC;
+        }
+        if (next_stats >= 0 && (next_release < 0 || next_stats < next_release))
+            next_release = next_stats;
+
+        // Serve the devices that had more to read than their batch last time
+        if (read_backlog > 0) {
+            for (int k = 0; k < device_count; k++) {
+                if (devices[k].fd >= 0 && devices[k].read_pending)
+                    read_device(k, current_time);
+            }
+            if (threaded)
+                wake_emitter();
+        }
+
+        // Wait for the next input event, but no longer than the release
+        // time of the oldest buffered event. With nothing buffered there is
+        // nothing to release, so sleep until input arrives. The timer only
+        // needs rearming when the next release time changes.
+        timeout = -1;
+        if (read_backlog > 0 || (next_release >= 0 && next_release <= current_time))
+            timeout = 0;
+        else if (next_release != armed) {
+            arm_timer(next_release);
+            armed = next_release;
+        }
+        if (vlog_running)
+            wake_vlog();
 
-        // Wait for next input event
-        if ((err = poll(pfds, device_count, POLL_TIMEOUT_MS)) < 0)
-            panic("poll() failed: %s\n", strerror(errno));
+        if ((nready = epoll_pwait(epoll_fd, ready, EPOLL_BATCH_SIZE, timeout, &wait_mask)) < 0) {
+            if (errno == EINTR)
+                continue;
+            panic("epoll_pwait() failed: %s\n", strerror(errno));
+        }
 
-        // timed out, do nothing
-        if (err == 0)
+        // timed out, release the due events
+        if (nready == 0)
             continue;
 
         // An event is available, mark the current time
-        current_time = current_time_ms();
-
-        // Buffer the event with a random delay
-        for (int k = 0; k < device_count; k++) {
-            if (pfds[k].revents & POLLIN) {
-                if ((err = read(pfds[k].fd, &ev, sizeof(ev))) <= 0)
-                    panic("read() failed: %s", strerror(errno));
-
-                // check for the rescue sequence.
-                if (!persistent) {
-                    if (ev.type == EV_KEY) {
-                        int all = 1;
-                        for (int j = 0; j < rescue_len; j++) {
-                            if (rescue_keys[j] == ev.code)
-                                rescue_state[j] = (ev.value == 0 ? 0 : 1);
-                            all = all && rescue_state[j];
-                        }
-                        if (all)
-                            interrupt = 1;
-                    }
-                }
-
-                // schedule the keyboard event to be released sometime in the future.
-                // lower bound must be bounded between time since last scheduled event and max delay
-                // preserves event order and bounds the maximum delay
-                lower_bound = min(max(prev_release_time - current_time, 0), max_delay);
-
-                // syn events are not delayed
-                if (ev.type == EV_SYN) {
-                    random_delay = lower_bound;
-                } else {
-                    random_delay = random_between(lower_bound, max_delay);
-                }
-
-                // Buffer the event
-                n1 = malloc(sizeof(struct entry));
-                if (n1 == NULL) {
-                    panic("Failed to allocate memory for entry");
-                }
-                n1->time = current_time + random_delay;
-                n1->iev = ev;
-                n1->device_index = k;
-                TAILQ_INSERT_TAIL(&head, n1, entries);
-
-                // Keep track of the previous scheduled release time
-                prev_release_time = n1->time;
-
-                if (verbose) {
-                    printf("Buffered event at time: %ld. Device: %d,  Type: %*d,  "
-                           "Code: %*d,  Value: %*d,  Scheduled delay: %*ld ms \n",
-                           n1->time, k, 3, n1->iev.type, 5, n1->iev.code, 5, n1->iev.value,
-                           4, random_delay);
-                    if (lower_bound > 0) {
-                        printf("Lower bound raised to: %*ld ms\n", 4, lower_bound);
-                    }
-                }
+        current_time = current_time_ns();
+
+        for (int r = 0; r < nready; r++) {
+            int k;
+
+            // the timer only has to wake us up, the due events are released
+            // at the top of the loop
+            if (ready[r].data.u32 == EPOLL_TIMER) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    panic("read() failed on the release timer: %s", strerror(errno));
+                armed = -1;
+                continue;
+            }
+            if (ready[r].data.u32 == EPOLL_HOTPLUG) {
+                handle_hotplug();
+                continue;
             }
+
+            // Buffer the event with a random delay
+            k = (int)ready[r].data.u32;
+            if (devices[k].fd < 0 || devices[k].read_pending)
+                continue;
+
+            read_device(k, current_time);
         }
-    }
 
-    free(pfds);
+        // one wakeup of the emitter for everything read this time
+        if (threaded)
+            wake_emitter();
+    }
 }
 
 void usage() {
@@ -414,22 +1755,91 @@ void usage() {
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -r filename: device file to read events from. Can specify multiple -r options.\n");
     fprintf(stderr, "  -d delay: maximum delay (milliseconds) of released events. Default 100.\n");
-    fprintf(stderr, "  -s startup_timeout: time to wait (milliseconds) before startup. Default 500.\n");
+    fprintf(stderr, "  -D name[:param]: distribution of the random delays within [lower bound,\n"
+            "     maximum delay]. Default uniform. One of:\n");
+    delay_list_distributions(stderr);
+    fprintf(stderr, "  -a delay: adaptive mode. The delay window follows the typing rate, shrinking\n"
+            "     for fast or very even typing down to this minimum (milliseconds), and is\n"
+            "     never larger than the maximum delay. Default disabled.\n");
+    fprintf(stderr, "  -m delay: maximum delay (milliseconds) of events from mice, touchpads and\n"
+            "     other non-keyboard devices. Default is the -d value. When set, keyboards and\n"
+            "     pointer devices are scheduled independently of each other.\n");
+    fprintf(stderr, "  -c window: coalesce queued relative motion (milliseconds). Consecutive mouse\n"
+            "     motion reports buffered within this window are merged into one, which adds at\n"
+            "     most the window to their delay. Default 0 (disabled).\n");
+    fprintf(stderr, "  -i: independent mode. Every device is scheduled on its own queue, so that\n"
+            "     events only have to stay in order with events of the same device.\n");
+    fprintf(stderr, "  -f: frame mode. The events of a device are held until the SYN_REPORT that\n"
+            "     ends their report, and the whole report gets one delay and is released in\n"
+            "     one piece, rather than every event getting a delay of its own.\n");
+    fprintf(stderr, "  -t: threaded mode. Events are released by a separate thread, so that reading\n"
+            "     input and verbose output never hold back releases that are due. -c and -f\n"
+            "     are not available.\n");
+    fprintf(stderr, "  -K: schedule events from the time the kernel received them rather than from\n"
+            "     when kloak read them, so that the maximum delay bounds the latency added\n"
+            "     since the hardware event. Devices are switched to CLOCK_MONOTONIC timestamps.\n");
+    fprintf(stderr, "  -R priority: run the thread releasing events, the emitter thread with -t and\n"
+            "     the main loop otherwise, with SCHED_FIFO at this priority (1-99). Default off.\n");
+    fprintf(stderr, "  -A cpus: pin kloak to these CPUs, a list such as 2 or 0,2-3. Default off.\n");
+    fprintf(stderr, "  -N nice: run kloak at this nice value (-20 to 19). Default unchanged.\n");
+    fprintf(stderr, "  -L: lock all memory once the devices are set up, so that no page of the\n"
+            "     event queues or the stack has to be faulted in while events are due.\n");
+    fprintf(stderr, "  -s startup_timeout: maximum time to wait (milliseconds) for held keys to be\n"
+            "     released before grabbing the devices. Default 500.\n");
     fprintf(stderr, "  -k csv_string: csv list of rescue key names to exit kloak in case the\n"
             "     keyboard becomes unresponsive. Default is 'KEY_LEFTSHIFT,KEY_RIGHTSHIFT,KEY_ESC'.\n");
     fprintf(stderr, "  -p: persistent mode (disable rescue key sequence)\n");
+    fprintf(stderr, "  -S filename: periodically write delay, latency and queue statistics to this\n"
+            "     file. The statistics are also printed to stdout on SIGUSR1.\n");
+    fprintf(stderr, "  -T interval: how often (seconds) the -S file is rewritten. Default 10.\n");
+    fprintf(stderr, "  -B runs: benchmark the startup. Detects the devices, grabs them and creates\n"
+            "     the output devices this many times, reports how long each phase took and\n"
+            "     exits.\n");
     fprintf(stderr, "  -v: verbose mode\n");
 }
 
 void banner() {
     printf("********************************************************************************\n"
            "* Started kloak : Keystroke-level Online Anonymizing Kernel\n"
-           "* Maximum delay : %d ms\n"
-           "* Reading from  : %s\n",
-           max_delay, named_inputs[0]);
+           "* Maximum delay : %d ms\n",
+           max_delay);
+    if (delay_distribution_param() > 0.0)
+        printf("* Distribution  : %s, %g\n", delay_distribution_name(), delay_distribution_param());
+    else
+        printf("* Distribution  : %s\n", delay_distribution_name());
+    if (min_adaptive_delay >= 0)
+        printf("* Adaptive      : down to %d ms\n", min_adaptive_delay);
+    if (max_motion_delay >= 0)
+        printf("* Pointer delay : %d ms\n", max_motion_delay);
+    if (independent)
+        printf("* Independent   : one queue per device\n");
+    if (frames)
+        printf("* Frames        : one delay per SYN_REPORT frame\n");
+    if (threaded && rt_priority > 0)
+        printf("* Threaded      : emitter thread, SCHED_FIFO priority %d\n", rt_priority);
+    else if (threaded)
+        printf("* Threaded      : emitter thread\n");
+    else if (rt_priority > 0)
+        printf("* Real-time     : main loop, SCHED_FIFO priority %d\n", rt_priority);
+    if (affinity_str[0] != '\0')
+        printf("* CPU affinity  : %s\n", affinity_str);
+    if (renice)
+        printf("* Nice          : %d\n", nice_level);
+    if (lock_memory)
+        printf("* Memory        : locked\n");
+    if (coalesce_window > 0)
+        printf("* Coalescing    : %d ms\n", coalesce_window);
+    if (kernel_time)
+        printf("* Timestamps    : kernel, CLOCK_MONOTONIC\n");
+    if (hotplug)
+        printf("* Hotplug       : watching /dev/input for new devices\n");
+    printf("* Startup       : ");
+    print_startup(stdout);
+    printf("\n");
+    printf("* Reading from  : %s\n", device_count > 0 ? devices[0].path : "(no devices yet)");
 
     for (int i = 1; i < device_count; i++) {
-        printf("*                 %s\n", named_inputs[i]);
+        printf("*                 %s\n", devices[i].path);
     }
     if (persistent) {
         printf("* Persistent mode, rescue keys disabled");
@@ -445,9 +1855,14 @@ void banner() {
 }
 
 int main(int argc, char **argv) {
+    int64_t t;
+
+    process_start = current_time_ns();
+    init_signals();
     if (sodium_init() == -1) {
         panic("sodium_init failed");
     }
+    rng_init();
 
     if ((getuid()) != 0)
         printf("You are not root! This may not work...\n");
@@ -456,17 +1871,17 @@ int main(int argc, char **argv) {
         is_qubes_vm = true;
     }
 
+    device_table_grow(DEVICE_TABLE_INITIAL);
+
     while (1) {
-        int c = getopt_long(argc, argv, "r:d:s:k:vph", long_options, NULL);
+        int c = getopt_long(argc, argv, "r:d:D:a:m:c:iftKR:A:N:Ls:k:S:T:B:vph", long_options, NULL);
 
         if (c < 0)
             break;
 
         switch (c) {
         case 'r':
-            if (device_count >= MAX_INPUTS)
-                panic("Too many -r options: can read from at most %d devices\n", MAX_INPUTS);
-            strtcpy(named_inputs[device_count++], optarg, BUFSIZE);
+            device_table_add(optarg);
             break;
 
         case 'd':
@@ -474,6 +1889,64 @@ int main(int argc, char **argv) {
                 panic("Maximum delay must be >= 0\n");
             break;
 
+        case 'D':
+            if (delay_set_distribution(optarg) != 0)
+                panic("Unknown delay distribution or invalid parameter: %s, see -h for the list\n", optarg);
+            break;
+
+        case 't':
+            threaded = 1;
+            break;
+
+        case 'K':
+            kernel_time = 1;
+            break;
+
+        case 'R':
+            if ((rt_priority = atoi(optarg)) < 1 || rt_priority > 99)
+                panic("Real-time priority must be between 1 and 99\n");
+            break;
+
+        case 'A':
+            strtcpy(affinity_str, optarg, BUFSIZE);
+            if (parse_cpu_list(affinity_str, &affinity) < 0)
+                panic("Invalid CPU list: %s\n", optarg);
+            break;
+
+        case 'N':
+            nice_level = atoi(optarg);
+            if (nice_level < -20 || nice_level > 19)
+                panic("Nice value must be between -20 and 19\n");
+            renice = 1;
+            break;
+
+        case 'L':
+            lock_memory = 1;
+            break;
+
+        case 'a':
+            if ((min_adaptive_delay = atoi(optarg)) < 0)
+                panic("Minimum adaptive delay must be >= 0\n");
+            break;
+
+        case 'm':
+            if ((max_motion_delay = atoi(optarg)) < 0)
+                panic("Maximum pointer delay must be >= 0\n");
+            break;
+
+        case 'c':
+            if ((coalesce_window = atoi(optarg)) < 0)
+                panic("Coalescing window must be >= 0\n");
+            break;
+
+        case 'i':
+            independent = 1;
+            break;
+
+        case 'f':
+            frames = 1;
+            break;
+
         case 's':
             if ((startup_timeout = atoi(optarg)) < 0)
                 panic("Startup timeout must be >= 0\n");
@@ -487,6 +1960,20 @@ int main(int argc, char **argv) {
             custom_rescue = 1;
             break;
 
+        case 'S':
+            strtcpy(stats_file, optarg, BUFSIZE);
+            break;
+
+        case 'T':
+            if ((stats_interval = atoi(optarg)) <= 0)
+                panic("Statistics interval must be > 0\n");
+            break;
+
+        case 'B':
+            if ((benchmark_runs = atoi(optarg)) <= 0)
+                panic("Number of startup benchmark runs must be > 0\n");
+            break;
+
         case 'v':
             verbose = 1;
             break;
@@ -509,30 +1996,56 @@ int main(int argc, char **argv) {
         }
     }
 
-    // autodetect devices if none were specified
-    if (device_count == 0)
+    init_epoll();
+
+    if (threaded && coalesce_window > 0)
+        panic("Coalescing (-c) is not available in threaded mode (-t)\n");
+    if (threaded && frames)
+        panic("Frame mode (-f) is not available in threaded mode (-t)\n");
+    check_build_variant();
+
+    if (benchmark_runs > 0) {
+        init_scheduler();
+        benchmark_startup(benchmark_runs);
+        cleanup();
+        exit(EXIT_SUCCESS);
+    }
+
+    // autodetect devices if none were specified, and keep watching for
+    // devices being plugged in
+    if (device_count == 0) {
+        hotplug = 1;
+        init_hotplug();
+        t = current_time_ns();
         detect_devices();
+        startup_ns[STARTUP_DETECT] = current_time_ns() - t;
+    }
 
-    // autodetect failed
-    if (device_count == 0)
-        panic("Unable to find any keyboards or mice. Specify which input device(s) to use with -r");
+    // autodetect failed, devices plugged in later will still be picked up
+    if (device_count == 0 && hotplug)
+        printf("Unable to find any keyboards or mice yet, waiting for one to be plugged in\n");
+    else if (device_count == 0)
+        panic("Unable to find any keyboards or mice\n");
 
     // set rescue keys from the default sequence or -k arg
     set_rescue_keys(rescue_keys_str);
 
-    // wait for pending events to finish, avoids keys being "held down"
-    printf("Waiting %d ms...\n", startup_timeout);
-    sleep_ms(startup_timeout);
+    init_scheduler();
 
     // open the input devices and create the output devices
     init_inputs();
     init_outputs();
-
-    // initialize the event queue
-    TAILQ_INIT(&head);
+    tune_process();
 
     banner();
+    if (verbose_mode())
+        start_vlog();
+    if (threaded)
+        start_emitter();
     main_loop();
+    stop_emitter();
+    if (verbose_mode())
+        stop_vlog();
 
     // close everything
     cleanup();
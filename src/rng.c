@@ -0,0 +1,76 @@
+#include <string.h>
+#include <sodium.h>
+#include "rng.h"
+
+static unsigned char key[crypto_stream_chacha20_KEYBYTES];
+static unsigned char block[RNG_BLOCK_SIZE];
+static size_t block_pos = RNG_BLOCK_SIZE;    // next unused byte of block
+static uint64_t nonce = 0;
+static unsigned int refills = 0;
+
+_Static_assert(RNG_BLOCK_SIZE > crypto_stream_chacha20_KEYBYTES,
+               "a block has to hold the next key and some output");
+
+void rng_init(void) {
+    randombytes_buf(key, sizeof(key));
+    nonce = 0;
+    refills = 0;
+    block_pos = RNG_BLOCK_SIZE;
+}
+
+static void rng_refill(void) {
+    unsigned char n[crypto_stream_chacha20_NONCEBYTES];
+
+    if (++refills >= RNG_RESEED_BLOCKS)
+        rng_init();
+
+    // every key is only ever used once, the nonce just has to be valid
+    memcpy(n, &nonce, sizeof(n));
+    nonce++;
+    crypto_stream_chacha20(block, sizeof(block), n, key);
+
+    // the first bytes of the keystream become the next key and are wiped
+    memcpy(key, block, sizeof(key));
+    sodium_memzero(block, sizeof(key));
+    block_pos = sizeof(key);
+}
+
+static void rng_bytes(void *out, size_t len) {
+    if (block_pos + len > sizeof(block))
+        rng_refill();
+    memcpy(out, block + block_pos, len);
+    sodium_memzero(block + block_pos, len);
+    block_pos += len;
+}
+
+// Returns a uniformly distributed value in [0, bound), or 0 if bound is 0.
+// Values past the largest multiple of bound are rejected, so the result
+// is unbiased; intervals that fit in 32 bits only use 4 bytes per draw.
+uint64_t rng_uniform(uint64_t bound) {
+    uint64_t value64;
+    uint32_t value32;
+
+    if (bound <= 1)
+        return 0;
+
+    if (bound <= UINT32_MAX) {
+        uint32_t limit = UINT32_MAX - (UINT32_MAX % (uint32_t)bound);
+        do {
+            rng_bytes(&value32, sizeof(value32));
+        } while (value32 >= limit);
+        return value32 % bound;
+    }
+
+    uint64_t limit = UINT64_MAX - (UINT64_MAX % bound);
+    do {
+        rng_bytes(&value64, sizeof(value64));
+    } while (value64 >= limit);
+    return value64 % bound;
+}
+
+// Erases the generator state, e.g. before exiting
+void rng_wipe(void) {
+    sodium_memzero(key, sizeof(key));
+    sodium_memzero(block, sizeof(block));
+    block_pos = RNG_BLOCK_SIZE;
+}
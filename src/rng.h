@@ -0,0 +1,18 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// Delays are drawn from a ChaCha20 keystream that is generated a block at
+// a time, so the per-event cost is a copy out of a buffer rather than a
+// call into libsodium. The key is replaced from the start of every block
+// it generates (fast key erasure), so earlier output cannot be recovered
+// from memory later, and reseeded from libsodium every RNG_RESEED_BLOCKS.
+#define RNG_BLOCK_SIZE 4096          // bytes of keystream generated per refill
+#define RNG_RESEED_BLOCKS 256        // refills between reseeds from the system RNG
+
+void rng_init(void);
+uint64_t rng_uniform(uint64_t);
+void rng_wipe(void);
+
+#endif
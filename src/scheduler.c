@@ -0,0 +1,545 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "scheduler.h"
+#include "stats.h"
+#include "vlog.h"
+#include "delay.h"
+
+#define SOURCES_INITIAL 8            // source slots allocated on first use, the table grows as needed
+#define FRAME_MAX 128                // events held per frame, longer frames are released in parts
+#define ADAPTIVE_EWMA_SHIFT 3        // weight of a new key press interval is 1/8
+#define ADAPTIVE_DEVIATION_SHIFT 2   // weight of a new deviation is 1/4
+#define ADAPTIVE_WINDOW_FACTOR 2     // adaptive delay window in key press intervals
+#define ADAPTIVE_DEVIATION_FACTOR 4  // or in deviations of the interval, whichever is smaller
+#define ADAPTIVE_PAUSE_NS 1000000000L // longer gaps are pauses, not typing
+
+#ifndef min
+#define min(a, b) ( ((a) < (b)) ? (a) : (b) )
+#endif
+
+#ifndef max
+#define max(a, b) ( ((a) > (b)) ? (a) : (b) )
+#endif
+
+struct sched_source {
+        int queue;          // index into queues
+        enum device_class class;
+        struct coalesce_state coalesce;
+        struct device_stats *stats;
+        struct entry *frame;        // FRAME_MAX events of the frame being read, in frame mode
+        unsigned int frame_len;
+};
+
+static struct sched_config config;
+
+// The options a build variant can fix, see scheduler.h
+static inline bool sched_verbose(void) {
+#ifdef KLOAK_VERBOSE
+    return KLOAK_VERBOSE;
+#else
+    return config.verbose;
+#endif
+}
+
+static inline int64_t class_max_delay(enum device_class class) {
+#if defined(KLOAK_PER_CLASS) && !KLOAK_PER_CLASS
+    (void)class;
+    return config.max_delay_ns[DEVICE_KEYBOARD];
+#else
+    return config.max_delay_ns[class];
+#endif
+}
+
+// Sources and queues are indexed by source id and grow together, so that
+// every source can have a queue of its own. Queues are allocated on first
+// use; only the first queue_count are in use.
+static struct sched_source *sources = NULL;
+static struct event_queue *queues = NULL;
+static int source_capacity = 0;
+static unsigned int queue_count = 0;
+// incremented on the thread releasing events, read by anyone printing them
+static atomic_ulong overflows = 0;  // events released early because the queue was full
+
+static int grow_sources(int capacity) {
+    struct sched_source *new_sources;
+    struct event_queue *new_queues;
+    int new_capacity = source_capacity ? source_capacity : SOURCES_INITIAL;
+
+    while (new_capacity < capacity)
+        new_capacity *= 2;
+
+    new_sources = realloc(sources, (size_t)new_capacity * sizeof(*sources));
+    if (new_sources == NULL)
+        return -1;
+    sources = new_sources;
+    new_queues = realloc(queues, (size_t)new_capacity * sizeof(*queues));
+    if (new_queues == NULL)
+        return -1;
+    queues = new_queues;
+
+    for (int i = source_capacity; i < new_capacity; i++) {
+        sources[i] = (struct sched_source){ 0 };
+        queues[i] = (struct event_queue){ 0 };
+    }
+    source_capacity = new_capacity;
+    return 0;
+}
+
+// Resets the scheduler to `cfg`, dropping all sources and buffered events.
+// Returns 0, or -1 if the configuration is invalid or out of memory.
+int sched_init(const struct sched_config *cfg) {
+    if (cfg->emit == NULL || cfg->max_delay_ns[DEVICE_KEYBOARD] < 0
+        || cfg->max_delay_ns[DEVICE_POINTER] < 0 || cfg->coalesce_window_ns < 0)
+        return -1;
+#if defined(KLOAK_PER_CLASS) && !KLOAK_PER_CLASS
+    if (cfg->max_delay_ns[DEVICE_POINTER] != cfg->max_delay_ns[DEVICE_KEYBOARD]
+        || cfg->grouping == SCHED_PER_CLASS)
+        return -1;
+#endif
+
+    sched_free();
+    config = *cfg;
+    queue_count = config.grouping == SCHED_PER_CLASS ? DEVICE_CLASS_COUNT : 1;
+    return grow_sources(SOURCES_INITIAL);
+}
+
+void sched_free(void) {
+    for (int i = 0; i < source_capacity; i++) {
+        queue_free(&queues[i]);
+        free(sources[i].stats);
+        free(sources[i].frame);
+    }
+    free(sources);
+    free(queues);
+    sources = NULL;
+    queues = NULL;
+    source_capacity = 0;
+    queue_count = 0;
+    overflows = 0;
+}
+
+// Adds source `id` of the given class, or resets it if its id is reused.
+// Returns 0, or -1 if out of memory.
+int sched_add_source(int id, enum device_class class) {
+    struct sched_source *s;
+    struct event_queue *q;
+
+    if (id >= source_capacity && grow_sources(id + 1) < 0)
+        return -1;
+    s = &sources[id];
+
+    s->class = class;
+    if (config.grouping == SCHED_PER_SOURCE)
+        s->queue = id;
+    else if (config.grouping == SCHED_PER_CLASS)
+        s->queue = (int)class;
+    else
+        s->queue = 0;
+    if ((unsigned int)s->queue >= queue_count)
+        queue_count = (unsigned int)s->queue + 1;
+
+    memset(&s->coalesce, 0, sizeof(s->coalesce));
+    s->coalesce.rel_only = true;
+    // slots keep their statistics buffer when they are reused
+    if (s->stats == NULL && (s->stats = malloc(sizeof(*s->stats))) == NULL)
+        return -1;
+    memset(s->stats, 0, sizeof(*s->stats));
+    s->frame_len = 0;
+    if (config.frames && s->frame == NULL && (s->frame = malloc(FRAME_MAX * sizeof(*s->frame))) == NULL)
+        return -1;
+
+    q = &queues[s->queue];
+    if (q->slots == NULL && queue_init(q, SCHED_QUEUE_CAPACITY) < 0)
+        return -1;
+    // a reused slot must not inherit the typing rate of the previous device
+    if (config.grouping == SCHED_PER_SOURCE)
+        q->last_press = q->press_interval = q->press_deviation = 0;
+    return 0;
+}
+
+// Drops the buffered events of source `id`. They stay queued as
+// placeholders, so that the release times around them are unchanged.
+void sched_remove_source(int id) {
+    struct event_queue *q = &queues[sources[id].queue];
+
+    sources[id].frame_len = 0;
+    for (size_t j = 0; j < q->count; j++) {
+        struct entry *e = queue_at(q, j);
+        if (e->device_index == id)
+            e->device_index = -1;
+    }
+}
+
+int sched_queue_of(int id) {
+    return sources[id].queue;
+}
+
+unsigned int sched_queue_count(void) {
+    return queue_count;
+}
+
+const struct event_queue *sched_queue(unsigned int i) {
+    return &queues[i];
+}
+
+struct device_stats *sched_stats(int id) {
+    return sources[id].stats;
+}
+
+// The maximum delay of the events on queue i. The sources of a per-class
+// queue share their class; a shared queue implies a single delay, the
+// keyboard one.
+int64_t sched_queue_max_delay(unsigned int i) {
+    if (config.grouping == SCHED_PER_CLASS)
+        return class_max_delay((enum device_class)i);
+    if (config.grouping == SCHED_PER_SOURCE)
+        return class_max_delay(sources[i].class);
+    return class_max_delay(DEVICE_KEYBOARD);
+}
+
+unsigned long sched_overflows(void) {
+    return atomic_load_explicit(&overflows, memory_order_relaxed);
+}
+
+int queue_init(struct event_queue *q, size_t capacity) {
+    q->slots = calloc(capacity, sizeof(struct entry));
+    if (q->slots == NULL)
+        return -1;
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->last_press = 0;
+    q->press_interval = 0;
+    q->press_deviation = 0;
+    return 0;
+}
+
+void queue_free(struct event_queue *q) {
+    free(q->slots);
+    q->slots = NULL;
+    q->capacity = 0;
+    q->count = 0;
+}
+
+struct entry *queue_peek(struct event_queue *q) {
+    if (q->count == 0)
+        return NULL;
+    return &q->slots[q->head];
+}
+
+void queue_pop(struct event_queue *q) {
+    q->head = (q->head + 1) & (q->capacity - 1);
+    q->count--;
+}
+
+struct entry *queue_tail(struct event_queue *q) {
+    if (q->count == 0)
+        return NULL;
+    return &q->slots[(q->head + q->count - 1) & (q->capacity - 1)];
+}
+
+// Returns the entry i positions after the head, which must exist
+struct entry *queue_at(struct event_queue *q, size_t i) {
+    return &q->slots[(q->head + i) & (q->capacity - 1)];
+}
+
+// Returns the slot for a new entry at the tail of the queue, or NULL if
+// the queue is full.
+struct entry *queue_push(struct event_queue *q) {
+    if (q->count == q->capacity)
+        return NULL;
+    return &q->slots[(q->head + q->count++) & (q->capacity - 1)];
+}
+
+// Releases an event, unless its source was removed while it was buffered
+static void release(const struct entry *e, int64_t now) {
+    if (e->device_index < 0)
+        return;
+    stats_record_released(sources[e->device_index].stats, now, e->time, e->arrival);
+    config.emit(e, now);
+}
+
+// Releases every buffered event that is due at `now`. Returns the release
+// time of the next buffered event, or -1 if all queues are empty.
+int64_t sched_release_due(int64_t now) {
+    struct entry *np;
+    int64_t next = -1;
+
+    for (unsigned int i = 0; i < queue_count; i++) {
+        while ((np = queue_peek(&queues[i])) && (now >= np->time)) {
+            release(np, now);
+            queue_pop(&queues[i]);
+        }
+        if (np && (next < 0 || np->time < next))
+            next = np->time;
+    }
+
+    return next;
+}
+
+// Returns the slot for a new entry at the tail of q. If the queue is full
+// its oldest event is released early rather than dropping input; this
+// keeps the FIFO order and bounds memory use.
+static struct entry *push_or_release(struct event_queue *q, int64_t now, bool log) {
+    struct entry *n1, *np;
+
+    if ((n1 = queue_push(q)) == NULL) {
+        np = queue_peek(q);
+        atomic_store_explicit(&overflows, atomic_load_explicit(&overflows, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        if (log)
+            vlog_record(VLOG_QUEUE_FULL, np->time, np->device_index, 0, 0, 0, 0);
+        release(np, now);
+        queue_pop(q);
+        n1 = queue_push(q);
+    }
+    return n1;
+}
+
+// Tries to fold an event of source k, due at release_time, into the frame
+// of relative motion that source k last queued, while that frame is still
+// entirely buffered at the tail of q. Motion deltas of the same code are
+// summed, new codes are inserted before the frame's SYN_REPORT, and the
+// whole frame moves to the later release time. The SYN_REPORT closing a
+// fully merged frame is dropped. Returns true if the event was absorbed.
+static bool coalesce_event(struct event_queue *q, int k, const struct input_event *ev, int64_t release_time) {
+    struct coalesce_state *cs = &sources[k].coalesce;
+    struct entry *tail, *e;
+    size_t i;
+
+    if (ev->type == EV_SYN && ev->code == SYN_REPORT && cs->appended == 0 && cs->merged) {
+        cs->merged = false;
+        return true;
+    }
+
+    if (ev->type != EV_REL || cs->appended > 0 || cs->target_len == 0)
+        return false;
+
+    // the target frame must still be fully queued and end the queue
+    tail = queue_tail(q);
+    if (q->count < cs->target_len || tail->device_index != k || tail->iev.type != EV_SYN) {
+        cs->target_len = 0;
+        return false;
+    }
+
+    if (release_time - cs->target_start > config.coalesce_window_ns)
+        return false;
+
+    for (i = 1; i < cs->target_len; i++) {
+        e = queue_at(q, q->count - 1 - i);
+        if (e->iev.code == ev->code) {
+            e->iev.value += ev->value;
+            break;
+        }
+    }
+    if (i == cs->target_len) {
+        // no event of this code in the frame, insert it before the SYN_REPORT
+        if ((e = queue_push(q)) == NULL)
+            return false;
+        *e = *tail;
+        tail->iev = *ev;
+        cs->target_len++;
+    }
+
+    // release times only grow towards the tail, so the FIFO order holds
+    for (i = 0; i < cs->target_len; i++) {
+        queue_at(q, q->count - 1 - i)->time = release_time;
+    }
+    cs->merged = true;
+
+    if (sched_verbose()) {
+        vlog_record(VLOG_COALESCED, release_time, k, ev->type, ev->code, ev->value, 0);
+    }
+
+    return true;
+}
+
+// Tracks whether the frame source k is queueing consists of relative
+// motion only, so that the next frame can be coalesced into it.
+static void coalesce_appended(int k, const struct input_event *ev, int64_t release_time) {
+    struct coalesce_state *cs = &sources[k].coalesce;
+
+    cs->target_len = 0;
+    if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+        if (cs->rel_only && cs->appended > 0) {
+            cs->target_len = cs->appended + 1;
+            cs->target_start = release_time;
+        }
+        cs->appended = 0;
+        cs->rel_only = true;
+        cs->merged = false;
+    } else {
+        cs->appended++;
+        if (ev->type != EV_REL)
+            cs->rel_only = false;
+    }
+}
+
+// The delay window for the typing rate of the queue, within
+// [min_adaptive_delay_ns, max_delay_ns]. Jitter much larger than the
+// intervals between keys adds latency without hiding them any better, so
+// fast typing gets a window of a few intervals. What identifies a typist
+// is how the intervals vary, so jitter much larger than that variation
+// does not hide more either: slow but even typing, whose intervals are
+// long but regular, gets a window of a few deviations. Until a rate is
+// known the full window is used.
+int64_t sched_adaptive_window(const struct event_queue *q, int64_t max_delay_ns) {
+    int64_t window;
+
+    if (q->press_interval == 0)
+        return max_delay_ns;
+    window = q->press_interval * ADAPTIVE_WINDOW_FACTOR;
+    if (q->press_deviation > 0)
+        window = min(window, q->press_deviation * ADAPTIVE_DEVIATION_FACTOR);
+    return max(min(window, max_delay_ns), min(config.min_adaptive_delay_ns, max_delay_ns));
+}
+
+// Tracks the typing rate of the queue and returns the delay window for ev
+static int64_t adaptive_max_delay(struct event_queue *q, const struct input_event *ev,
+                                  int64_t now, int64_t max_delay_ns) {
+    int64_t interval;
+
+    if (ev->type == EV_KEY && ev->value == 1) {
+        interval = now - q->last_press;
+        if (q->last_press > 0 && interval < ADAPTIVE_PAUSE_NS) {
+            // the deviation is measured against the mean before this
+            // interval moves it, as TCP does for its round-trip time
+            if (q->press_interval == 0) {
+                q->press_interval = interval;
+            } else {
+                q->press_deviation += (llabs(interval - q->press_interval) - q->press_deviation)
+                                      >> ADAPTIVE_DEVIATION_SHIFT;
+                q->press_interval += (interval - q->press_interval) >> ADAPTIVE_EWMA_SHIFT;
+            }
+        }
+        q->last_press = now;
+    }
+    return sched_adaptive_window(q, max_delay_ns);
+}
+
+// The delay window of source k for ev. In adaptive mode this tracks the
+// typing rate of its queue.
+static int64_t delay_window(int k, const struct input_event *ev, int64_t now) {
+    int64_t max_delay_ns = class_max_delay(sources[k].class);
+
+    if (config.min_adaptive_delay_ns >= 0)
+        return adaptive_max_delay(&queues[sources[k].queue], ev, now, max_delay_ns);
+    return max_delay_ns;
+}
+
+// Picks a delay within the window, or just the lower bound if the events
+// are not delayed. `tail` is the release time of the last event scheduled
+// on the queue of source k, or -1 if there is none; the lower bound
+// derived from it is stored in *lower_bound.
+static int64_t pick_delay(int k, int64_t window, bool delayed, int64_t now, int64_t tail,
+                          int64_t *lower_bound) {
+    int64_t max_delay_ns = class_max_delay(sources[k].class);
+
+    // lower bound must be bounded between time since last scheduled event and max delay
+    // preserves event order and bounds the maximum delay. It is not capped by
+    // the adaptive window, which may have shrunk below events already queued.
+    *lower_bound = 0;
+    if (tail >= 0)
+        *lower_bound = min(max(tail - now, 0), max_delay_ns);
+
+    if (!delayed)
+        return *lower_bound;
+    return delay_sample(*lower_bound, max(window, *lower_bound));
+}
+
+// Picks the delay of an event of source k. `tail` is the release time of
+// the last event scheduled on its queue, or -1 if there is none; the lower
+// bound derived from it is stored in *lower_bound. On its own this does
+// not queue anything, see sched_insert().
+int64_t sched_delay(int k, const struct input_event *ev, int64_t now, int64_t tail,
+                    int64_t *lower_bound) {
+    // syn events are not delayed
+    return pick_delay(k, delay_window(k, ev, now), ev->type != EV_SYN, now, tail, lower_bound);
+}
+
+// Queues an event of source k that arrived at `arrival` for release at
+// release_time, unless it can be merged into the frame queued before it
+static void append_event(int k, struct event_queue *q, const struct input_event *ev, int64_t arrival,
+                         int64_t release_time, int64_t lower_bound, int64_t now) {
+    struct entry *n1;
+
+    stats_record_buffered(sources[k].stats, arrival, release_time - arrival, q->count);
+
+    if (config.coalesce_window_ns > 0) {
+        if (coalesce_event(q, k, ev, release_time))
+            return;
+    }
+
+    n1 = push_or_release(q, now, sched_verbose());
+    n1->time = release_time;
+    n1->arrival = arrival;
+    n1->iev = *ev;
+    n1->device_index = k;
+
+    if (config.coalesce_window_ns > 0)
+        coalesce_appended(k, ev, n1->time);
+
+    if (sched_verbose()) {
+        vlog_record(VLOG_BUFFERED, n1->time, k, ev->type, ev->code, ev->value, release_time - arrival);
+        if (lower_bound > 0) {
+            vlog_record(VLOG_LOWER_BOUND, n1->time, k, 0, 0, 0, lower_bound);
+        }
+    }
+}
+
+// Queues the frame held for source k with a single delay, so that it is
+// released in one piece. The frame is delayed if any of its events is.
+static int64_t release_frame(int k, int64_t now) {
+    struct sched_source *s = &sources[k];
+    struct event_queue *q = &queues[s->queue];
+    int64_t window = class_max_delay(s->class);
+    int64_t lower_bound, release_time;
+    struct entry *np;
+    bool delayed = false;
+
+    for (unsigned int i = 0; i < s->frame_len; i++) {
+        window = delay_window(k, &s->frame[i].iev, s->frame[i].arrival);
+        delayed |= s->frame[i].iev.type != EV_SYN;
+    }
+    np = queue_tail(q);
+    release_time = now + pick_delay(k, window, delayed, now, np ? np->time : -1, &lower_bound);
+
+    for (unsigned int i = 0; i < s->frame_len; i++)
+        append_event(k, q, &s->frame[i].iev, s->frame[i].arrival, release_time, lower_bound, now);
+    s->frame_len = 0;
+    return release_time;
+}
+
+// Schedules an event read from source k at time `now` for release sometime
+// in the future. Returns its release time, or in frame mode -1 while the
+// event is held until the SYN_REPORT closing its frame.
+int64_t sched_schedule(int k, const struct input_event *ev, int64_t now) {
+    struct sched_source *s = &sources[k];
+    struct event_queue *q = &queues[s->queue];
+    int64_t lower_bound;
+    int64_t random_delay;
+    struct entry *np;
+
+    if (config.frames) {
+        s->frame[s->frame_len].iev = *ev;
+        s->frame[s->frame_len].arrival = now;
+        s->frame_len++;
+        if ((ev->type == EV_SYN && ev->code == SYN_REPORT) || s->frame_len == FRAME_MAX)
+            return release_frame(k, now);
+        return -1;
+    }
+
+    np = queue_tail(q);
+    random_delay = sched_delay(k, ev, now, np ? np->time : -1, &lower_bound);
+    append_event(k, q, ev, now, now + random_delay, lower_bound, now);
+    return now + random_delay;
+}
+
+// Queues an entry whose release time was already picked with
+// sched_delay(), as threaded mode does on the emitter thread. The entry
+// must not be due before the last one on its queue. Nothing is recorded
+// with vlog_record(), which belongs to the thread that picked the delay.
+void sched_insert(const struct entry *e, int64_t now) {
+    *push_or_release(&queues[sources[e->device_index].queue], now, false) = *e;
+}
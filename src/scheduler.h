@@ -0,0 +1,118 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+// The scheduler assigns every event read from a source (an input device)
+// a random release time and hands it back through the emit callback once
+// that time has come. It does no I/O and never reads the clock: every call
+// is given the current time, so the scheduler can be driven by kloak's
+// main loop, a simulated clock or a test alike. It is built into
+// libkloak.a together with the modules it uses.
+#define SCHED_QUEUE_CAPACITY 4096    // max buffered events per queue, must be a power of two
+
+// Build variants. kloak-fast (see the Makefile) defines these to 0 or 1
+// to fix an option at build time, so that the scheduling and release path
+// checks nothing for it and carries no code for the mode it was not built
+// for. Left undefined, the option is read from sched_config and the
+// command line as usual.
+//   KLOAK_VERBOSE     vlog_record() calls, kloak's -v
+//   KLOAK_PERSISTENT  no rescue key check, kloak's -p
+//   KLOAK_PER_CLASS   0 drops the separate pointer delay of -m; sched_init()
+//                     then rejects different delays per class
+
+// Devices are scheduled by class so pointer motion can get its own
+// latency budget and not hold back keystrokes.
+enum device_class {
+        DEVICE_KEYBOARD,
+        DEVICE_POINTER,     // mice, touchpads and anything else that is not a keyboard
+        DEVICE_CLASS_COUNT
+};
+
+#define MIN_KEYBOARD_KEYS 20         // a keyboard has more keys than this
+
+// The class of a device supporting EV_KEY with this many keys. kloak and
+// kloak-bench both classify devices with it, so a replayed trace lands in
+// the same queues as the devices it was captured from.
+static inline enum device_class device_class_of(int key_count) {
+    return key_count > MIN_KEYBOARD_KEYS ? DEVICE_KEYBOARD : DEVICE_POINTER;
+}
+
+// Which sources share a queue, and so one FIFO lower bound
+enum sched_grouping {
+        SCHED_SHARED,       // all sources
+        SCHED_PER_CLASS,    // the sources of each device class
+        SCHED_PER_SOURCE,   // none, every source has its own queue
+};
+
+struct entry {
+        struct input_event iev;
+        int64_t time;   // release time, CLOCK_MONOTONIC nanoseconds
+        int64_t arrival;    // time the event was read
+        int device_index;   // source of the event, -1 once it has been removed
+};
+
+// Per-source bookkeeping for merging relative motion into the frame the
+// source queued last
+struct coalesce_state {
+        size_t target_len;      // entries of the mergeable tail frame, 0 if none
+        int64_t target_start;   // release time the tail frame was first given
+        unsigned int appended;  // events of the current frame appended to the queue
+        bool rel_only;          // all appended events of the current frame are EV_REL
+        bool merged;            // events of the current frame were merged into the tail frame
+};
+
+// Fixed-capacity ring buffer of entries. Release times never decrease
+// from head to tail, so the head is always the next event due.
+struct event_queue {
+        struct entry *slots;
+        size_t capacity;    // power of two
+        size_t head;        // index of the oldest entry
+        size_t count;
+        int64_t last_press;     // arrival of the last key press, for adaptive mode
+        int64_t press_interval; // EWMA of the time between key presses, 0 until measured
+        int64_t press_deviation;    // EWMA of how far an interval is from press_interval
+};
+
+struct sched_config {
+        int64_t max_delay_ns[DEVICE_CLASS_COUNT];
+        int64_t min_adaptive_delay_ns;  // adaptive mode shrinks the window down to this, -1 disables
+        int64_t coalesce_window_ns;     // merge relative motion queued within this window, 0 disables
+        enum sched_grouping grouping;
+        bool frames;                    // hold events until their SYN_REPORT, give every frame one delay
+        bool verbose;                   // record scheduling decisions with vlog_record()
+        // Called for every event released, in release order. The events
+        // due at one time are released by one sched_release_due() call.
+        void (*emit)(const struct entry *, int64_t);
+};
+
+struct device_stats;
+
+int sched_init(const struct sched_config *);
+void sched_free(void);
+int sched_add_source(int, enum device_class);
+void sched_remove_source(int);
+int sched_queue_of(int);
+unsigned int sched_queue_count(void);
+const struct event_queue *sched_queue(unsigned int);
+struct device_stats *sched_stats(int);
+unsigned long sched_overflows(void);
+int64_t sched_queue_max_delay(unsigned int);
+int64_t sched_adaptive_window(const struct event_queue *, int64_t);
+int64_t sched_delay(int, const struct input_event *, int64_t, int64_t, int64_t *);
+int64_t sched_schedule(int, const struct input_event *, int64_t);
+void sched_insert(const struct entry *, int64_t);
+int64_t sched_release_due(int64_t);
+
+int queue_init(struct event_queue *, size_t);
+void queue_free(struct event_queue *);
+struct entry *queue_peek(struct event_queue *);
+void queue_pop(struct event_queue *);
+struct entry *queue_tail(struct event_queue *);
+struct entry *queue_at(struct event_queue *, size_t);
+struct entry *queue_push(struct event_queue *);
+
+#endif
@@ -0,0 +1,136 @@
+#include "stats.h"
+
+#define NS_PER_MS 1000000.0
+#define NS_PER_SEC 1000000000L
+
+// see struct histogram: each field has one writer, so no atomic
+// read-modify-write is needed to update it
+#define LOAD(field) atomic_load_explicit(&(field), memory_order_relaxed)
+#define STORE(field, value) atomic_store_explicit(&(field), (value), memory_order_relaxed)
+#define BUMP(field) STORE(field, LOAD(field) + 1)
+
+static size_t histogram_index(uint64_t value) {
+    unsigned int exponent;
+
+    if (value >= (1ULL << HIST_MAX_BITS))
+        value = (1ULL << HIST_MAX_BITS) - 1;
+    if (value < HIST_SUB_COUNT)
+        return (size_t)value;
+
+    // position of the highest set bit selects the power of two, the next
+    // HIST_SUB_BITS bits select the linear sub-bucket inside it
+    exponent = 63U - (unsigned int)__builtin_clzll(value);
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_COUNT
+           + ((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+// Middle of the range of values that map to the bucket
+static int64_t histogram_value(size_t index) {
+    size_t shift;
+
+    if (index < HIST_SUB_COUNT)
+        return (int64_t)index;
+    shift = index / HIST_SUB_COUNT - 1;
+    return (int64_t)(((HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift) + ((1UL << shift) >> 1));
+}
+
+void histogram_record(struct histogram *h, int64_t value) {
+    if (value < 0)
+        value = 0;
+
+    BUMP(h->counts[histogram_index((uint64_t)value)]);
+    if (LOAD(h->total) == 0 || value < LOAD(h->min))
+        STORE(h->min, value);
+    if (LOAD(h->total) == 0 || value > LOAD(h->max))
+        STORE(h->max, value);
+    STORE(h->sum, LOAD(h->sum) + (double)value);
+    BUMP(h->total);
+}
+
+// Returns the value at or below which the given fraction of the recorded
+// values lie, to the precision of the bucket it falls into
+int64_t histogram_percentile(const struct histogram *h, double fraction) {
+    uint64_t rank, seen = 0, total = LOAD(h->total);
+    int64_t min = LOAD(h->min), max = LOAD(h->max);
+
+    if (total == 0)
+        return 0;
+
+    rank = (uint64_t)(fraction * (double)total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    for (size_t i = 0; i < HIST_BUCKET_COUNT; i++) {
+        seen += LOAD(h->counts[i]);
+        if (seen >= rank) {
+            int64_t value = histogram_value(i);
+            if (value < min)
+                return min;
+            return (value > max) ? max : value;
+        }
+    }
+    return max;
+}
+
+void stats_record_buffered(struct device_stats *s, int64_t now, int64_t delay, size_t depth) {
+    histogram_record(&s->scheduled_delay, delay);
+    histogram_record(&s->queue_depth, (int64_t)depth);
+    BUMP(s->events);
+
+    if (now - s->window_start >= NS_PER_SEC) {
+        s->window_start = now;
+        s->window_events = 0;
+    }
+    if (++s->window_events > LOAD(s->peak_rate))
+        STORE(s->peak_rate, s->window_events);
+}
+
+void stats_record_released(struct device_stats *s, int64_t now, int64_t target, int64_t arrival) {
+    histogram_record(&s->actual_delay, now - arrival);
+    histogram_record(&s->missed_target, now - target);
+    if (now < target)
+        BUMP(s->early_releases);
+}
+
+void stats_record_read(struct device_stats *s, size_t events) {
+    histogram_record(&s->read_events, (int64_t)events);
+}
+
+void stats_record_drop(struct device_stats *s) {
+    BUMP(s->drops);
+}
+
+static void print_histogram(FILE *f, const char *label, const struct histogram *h, double scale) {
+    uint64_t total = LOAD(h->total);
+
+    fprintf(f, "  %-16s min %9.3f  p50 %9.3f  p90 %9.3f  p99 %9.3f  p99.9 %9.3f  max %9.3f  mean %9.3f\n",
+            label,
+            (double)LOAD(h->min) / scale,
+            (double)histogram_percentile(h, 0.50) / scale,
+            (double)histogram_percentile(h, 0.90) / scale,
+            (double)histogram_percentile(h, 0.99) / scale,
+            (double)histogram_percentile(h, 0.999) / scale,
+            (double)LOAD(h->max) / scale,
+            total ? LOAD(h->sum) / (double)total / scale : 0.0);
+}
+
+void stats_print_device(FILE *f, const char *name, const struct device_stats *s, int64_t uptime) {
+    double seconds = (double)uptime / NS_PER_SEC;
+    uint64_t events = LOAD(s->events);
+
+    fprintf(f, "%s: %llu events, %.1f events/s (peak %llu/s), %llu released early, "
+            "%llu kernel buffer overflows\n",
+            name, (unsigned long long)events,
+            seconds > 0 ? (double)events / seconds : 0.0,
+            (unsigned long long)LOAD(s->peak_rate), (unsigned long long)LOAD(s->early_releases),
+            (unsigned long long)LOAD(s->drops));
+    if (events == 0)
+        return;
+    print_histogram(f, "scheduled (ms)", &s->scheduled_delay, NS_PER_MS);
+    print_histogram(f, "actual (ms)", &s->actual_delay, NS_PER_MS);
+    print_histogram(f, "missed (ms)", &s->missed_target, NS_PER_MS);
+    print_histogram(f, "queue depth", &s->queue_depth, 1.0);
+    // kloak-bench replays events without reading any
+    if (LOAD(s->read_events.total) > 0)
+        print_histogram(f, "read per wakeup", &s->read_events, 1.0);
+}
@@ -0,0 +1,51 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Log-linear histogram in the style of HdrHistogram: values below
+// HIST_SUB_COUNT are counted exactly, larger values land in one of
+// HIST_SUB_COUNT linear sub-buckets per power of two, which keeps the
+// relative error under 1/HIST_SUB_COUNT (~3%).
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40             // values are clamped to 2^40 - 1 (~18 minutes in ns)
+#define HIST_BUCKET_COUNT ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+// Every field has a single writer, but in threaded mode the emitter thread
+// records the releases while the main thread prints them. The fields are
+// atomics so that printing never races with recording; the writers use
+// relaxed loads and stores, which cost no more than plain ones.
+struct histogram {
+        _Atomic uint64_t counts[HIST_BUCKET_COUNT];
+        _Atomic uint64_t total;
+        _Atomic int64_t min;
+        _Atomic int64_t max;
+        _Atomic double sum;
+};
+
+struct device_stats {
+        struct histogram scheduled_delay;   // ns between arrival and target release
+        struct histogram actual_delay;      // ns between arrival and actual release
+        struct histogram missed_target;     // ns an event was released after its target
+        struct histogram queue_depth;       // entries queued when an event is buffered
+        struct histogram read_events;       // events read per wakeup, up to the read batch
+        _Atomic uint64_t events;            // events read from the device
+        _Atomic uint64_t early_releases;    // events released before their target
+        _Atomic uint64_t drops;             // SYN_DROPPED, the kernel buffer overflowed and was resynced
+        uint64_t window_events;             // events in the current rate window, writer only
+        int64_t window_start;               // start of the current one second window, writer only
+        _Atomic uint64_t peak_rate;         // highest events per second seen
+};
+
+void histogram_record(struct histogram *, int64_t);
+int64_t histogram_percentile(const struct histogram *, double);
+void stats_record_buffered(struct device_stats *, int64_t, int64_t, size_t);
+void stats_record_released(struct device_stats *, int64_t, int64_t, int64_t);
+void stats_record_read(struct device_stats *, size_t);
+void stats_record_drop(struct device_stats *);
+void stats_print_device(FILE *, const char *, const struct device_stats *, int64_t);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Binary input traces, as written by `eventcap -w` and replayed by
+// kloak-bench, in the byte order of the machine that captured them. The
+// file is a trace_header, padded to TRACE_DATA_OFFSET, followed by a ring
+// of `capacity` trace_records that eventcap preallocates and writes
+// through a shared mapping. Record i of the capture is at index
+// i % capacity; once `written` exceeds the capacity, the oldest records
+// have been overwritten. A ring that never wrapped is truncated to the
+// records written when capturing stops.
+#define TRACE_MAGIC "kloaktrc"       // 8 bytes, not NUL terminated
+#define TRACE_VERSION 2
+#define TRACE_MAX_DEVICES 16         // devices one trace can capture at once
+#define TRACE_NAME_SIZE 80
+#define TRACE_KEY_WORDS 12           // 64-bit words of the key bitmap, KEY_MAX is 0x2ff
+#define TRACE_DATA_OFFSET 4096       // the records start on their own page
+
+struct trace_device {
+        char name[TRACE_NAME_SIZE];  // from EVIOCGNAME, NUL terminated
+        uint16_t bustype;            // struct input_id, from EVIOCGID
+        uint16_t vendor;
+        uint16_t product;
+        uint16_t version;
+        uint32_t ev_bits;            // event types the device supports, from EVIOCGBIT(0)
+        uint32_t key_count;          // keys the device supports, to classify it like kloak does
+        uint64_t key_bits[TRACE_KEY_WORDS];
+        uint64_t rel_bits;
+        uint64_t abs_bits;
+};
+
+struct trace_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t clock_id;           // clock of the timestamps, e.g. CLOCK_MONOTONIC
+        uint32_t record_size;        // sizeof(struct trace_record)
+        uint32_t device_count;
+        uint64_t capacity;           // records in the ring
+        uint64_t written;            // records written in total, updated after every batch
+        uint64_t dropped;            // SYN_DROPPED reports, events the kernel had to discard
+        struct trace_device devices[TRACE_MAX_DEVICES];
+};
+
+struct trace_record {
+        int64_t time;                // event timestamp in nanoseconds
+        uint16_t type;
+        uint16_t code;
+        int32_t value;
+        uint16_t device;             // index into the header's devices
+        uint16_t reserved[3];
+};
+
+_Static_assert(sizeof(struct trace_header) <= TRACE_DATA_OFFSET, "trace header must fit its page");
+_Static_assert(sizeof(struct trace_record) == 24, "trace records must not contain padding");
+
+#endif
@@ -0,0 +1,120 @@
+#include <errno.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "vlog.h"
+
+#define NS_PER_MS 1000000.0
+#define VLOG_LINE_SIZE 256           // longest formatted record
+#define VLOG_WRITE_SIZE 8192         // bytes formatted per write()
+
+// Single producer, single consumer: vlog_record() only writes ring_tail,
+// vlog_flush() only writes ring_head. Both count up and are masked on use.
+static struct vlog_record ring[VLOG_CAPACITY];
+static atomic_size_t ring_head = 0;     // oldest record not yet flushed
+static atomic_size_t ring_tail = 0;     // next record to store
+static atomic_ulong dropped = 0;
+
+// Stores a record, or drops it if the ring is full. Never blocks.
+void vlog_record(enum vlog_kind kind, int64_t time, int device, unsigned int type,
+                 unsigned int code, int value, int64_t delay) {
+    size_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    struct vlog_record *r;
+
+    if (tail - atomic_load_explicit(&ring_head, memory_order_acquire) == VLOG_CAPACITY) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    r = &ring[tail & (VLOG_CAPACITY - 1)];
+    r->kind = (uint8_t)kind;
+    r->time = time;
+    r->device = (int16_t)device;
+    r->type = (uint16_t)type;
+    r->code = (uint16_t)code;
+    r->value = value;
+    r->delay = delay;
+    atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+}
+
+size_t vlog_pending(void) {
+    return atomic_load_explicit(&ring_tail, memory_order_acquire)
+           - atomic_load_explicit(&ring_head, memory_order_acquire);
+}
+
+static int format_record(char *buf, size_t size, const struct vlog_record *r) {
+    switch ((enum vlog_kind)r->kind) {
+    case VLOG_BUFFERED:
+        return snprintf(buf, size, "Buffered event at time: %" PRId64 ". Device: %d,  Type: %*d,  "
+                        "Code: %*d,  Value: %*d,  Scheduled delay: %*.3f ms \n",
+                        r->time, r->device, 3, r->type, 5, r->code, 5, r->value,
+                        8, (double)r->delay / NS_PER_MS);
+    case VLOG_LOWER_BOUND:
+        return snprintf(buf, size, "Lower bound raised to: %*.3f ms\n", 8, (double)r->delay / NS_PER_MS);
+    case VLOG_RELEASED:
+        return snprintf(buf, size, "Released event at time : %" PRId64 ". Device: %d,  Type: %*d,  "
+                        "Code: %*d,  Value: %*d,  Missed target:  %*.3f ms \n",
+                        r->time, r->device, 3, r->type, 5, r->code, 5, r->value,
+                        9, (double)r->delay / NS_PER_MS);
+    case VLOG_COALESCED:
+        return snprintf(buf, size, "Coalesced event into frame at time: %" PRId64 ". Device: %d,  Type: %*d,  "
+                        "Code: %*d,  Value: %*d\n",
+                        r->time, r->device, 3, r->type, 5, r->code, 5, r->value);
+    case VLOG_QUEUE_FULL:
+        return snprintf(buf, size, "Queue full, releasing oldest event early\n");
+    case VLOG_DROPPED:
+        return snprintf(buf, size, "Kernel dropped events at time: %" PRId64 ". Device: %d, resyncing\n",
+                        r->time, r->device);
+    }
+    return 0;
+}
+
+// Writes all of buf to fd, even if that blocks. Returns -1 on error.
+static int write_all(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Formats and writes up to max_records records to fd, oldest first. This
+// blocks as long as fd does, so except when exiting it runs on a thread
+// of its own, never on the one releasing events. Returns the number of
+// records still pending.
+size_t vlog_flush(int fd, size_t max_records) {
+    char buf[VLOG_WRITE_SIZE];
+    size_t len = 0;
+    size_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    unsigned long lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+    int n;
+
+    if (lost > 0)
+        len += (size_t)snprintf(buf, sizeof(buf), "Verbose output fell behind, %lu records dropped\n", lost);
+
+    while (head != tail && max_records-- > 0) {
+        if (sizeof(buf) - len < VLOG_LINE_SIZE) {
+            if (write_all(fd, buf, len) < 0)
+                break;
+            len = 0;
+        }
+        n = format_record(buf + len, sizeof(buf) - len, &ring[head & (VLOG_CAPACITY - 1)]);
+        len += (size_t)n;
+        head++;
+        // hand the slot back as soon as it is formatted
+        atomic_store_explicit(&ring_head, head, memory_order_release);
+    }
+    if (len > 0)
+        write_all(fd, buf, len);
+
+    return atomic_load_explicit(&ring_tail, memory_order_acquire) - head;
+}
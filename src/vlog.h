@@ -0,0 +1,36 @@
+#ifndef VLOG_H
+#define VLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Verbose output is recorded as fixed-size binary records in a ring and
+// formatted and written by another thread, so a slow stdout (e.g.
+// journald) never holds back the release of events. One thread records,
+// one flushes.
+#define VLOG_CAPACITY 8192           // records, must be a power of two
+
+enum vlog_kind {
+        VLOG_BUFFERED,      // delay: scheduled delay
+        VLOG_LOWER_BOUND,   // delay: raised lower bound
+        VLOG_RELEASED,      // delay: missed target
+        VLOG_COALESCED,
+        VLOG_QUEUE_FULL,
+        VLOG_DROPPED,       // time: when the SYN_DROPPED was read
+};
+
+struct vlog_record {
+        int64_t time;       // release time of the event
+        int64_t delay;
+        int32_t value;
+        uint16_t type;
+        uint16_t code;
+        int16_t device;
+        uint8_t kind;
+};
+
+void vlog_record(enum vlog_kind, int64_t, int, unsigned int, unsigned int, int, int64_t);
+size_t vlog_pending(void);
+size_t vlog_flush(int, size_t);
+
+#endif